@@ -44,25 +44,33 @@ void Sort(uint64_t n) {
 
     const int repeat = 20;
 
-    hrc::time_point st, en; double el = 0;
-    printf("Running aspas::sort on N: %llu, Keysize: %lu bytes ...\n", n, Keysize);
-    FOR(i, repeat, 1) {
-        printf("Iter: %3lu ... ", i);
-        memcpy(A, A_copy, sz);
-        Key* p = A, * endp = A + tot_n;
-        st = hrc::now();
-        while (p < endp) {
-            aspas::sort(p, n); 
-            //aspas::parallel_sort<int>(p, n);
-            p += n;
+    // merge path against the radix engine; the selector (AUTO) picks one of them
+    const aspas::sort_engine engines[] = { aspas::sort_engine::MERGE, aspas::sort_engine::RADIX };
+    const char* engine_names[] = { "merge", "radix" };
+
+    FOR(m, 2, 1) {
+        aspas::sort_engine_mode = engines[m];
+        hrc::time_point st, en; double el = 0;
+        printf("Running aspas::sort (%s) on N: %llu, Keysize: %lu bytes ...\n", engine_names[m], n, Keysize);
+        FOR(i, repeat, 1) {
+            printf("Iter: %3lu ... ", i);
+            memcpy(A, A_copy, sz);
+            Key* p = A, * endp = A + tot_n;
+            st = hrc::now();
+            while (p < endp) {
+                aspas::sort(p, n); 
+                //aspas::parallel_sort<int>(p, n);
+                p += n;
+            }
+            en = hrc::now();
+            el += ELAPSED_MS(st, en);
+            printf("\r");
         }
-        en = hrc::now();
-        el += ELAPSED_MS(st, en);
-        printf("\r");
-    }
     
-    printf("\r                                 \r");
-    printf("Elapsed: %.2f ms/iter, Speed: %.2f M/s\n", el / repeat, tot_n * repeat / el / 1e3);
+        printf("\r                                 \r");
+        printf("> %-6s Elapsed: %.2f ms/iter, Speed: %.2f M/s\n", engine_names[m], el / repeat, tot_n * repeat / el / 1e3);
+    }
+    aspas::sort_engine_mode = aspas::sort_engine::AUTO;
 
     if (A[132] == 123) printf("\n");
 
@@ -116,36 +124,110 @@ void merge_test(bool in_cache = false) {
     printf("done\n");
 
     printf("Start merge on total: %llu, per stream: %llu ...\n", n_tot, lenA);
-    int total_clocks = 0;
 
     uint64_t repeat = in_cache ? 1e4 : 100;
 
-    double el = 0;
+    // compare the branchy and branch-free main loops against the automatic choice
+    const aspas::merge_loop modes[] = { aspas::merge_loop::AUTO, aspas::merge_loop::BRANCHY, aspas::merge_loop::BRANCHLESS };
+    const char* mode_names[] = { "auto", "branchy", "branchless" };
+
+    FOR(m, 3, 1) {
+        aspas::merge_loop_mode = modes[m];
+        double el = 0;
+
+        FOR(j, repeat, 1) {
+            hrc::time_point st = hrc::now();
+            aspas::merge(A, lenA, A + lenA, lenA, C);
+            hrc::time_point en = hrc::now();
+            el += ELAPSED_MS(st, en);
+            //ui violations = 0;
+            //FOR(i, n_tot - 1, 1) {
+            //	if (C[i] > C[i + 1]) {
+            //		violations++;
+            //		//printf("Violation @ %llu\n", i);
+            //		//break;
+            //	}
+            //}
+            //printf("Violations  %llu\n", violations);
+        }
+        printf("> %-10s merged in %.3f ms, speed %.1f M/sec\n", mode_names[m], el / repeat, (double)n_tot * repeat / el / 1e3);
+    }
+    aspas::merge_loop_mode = aspas::merge_loop::AUTO;
 
+    // same pair, split by merge path over thread_num threads
+    double el = 0;
     FOR(j, repeat, 1) {
         hrc::time_point st = hrc::now();
-        aspas::merge(A, lenA, A + lenA, lenA, C);
+        aspas::parallel_merge(A, lenA, A + lenA, lenA, C);
         hrc::time_point en = hrc::now();
         el += ELAPSED_MS(st, en);
-        //ui violations = 0;
-        //FOR(i, n_tot - 1, 1) {
-        //	if (C[i] > C[i + 1]) {
-        //		violations++;
-        //		//printf("Violation @ %llu\n", i);
-        //		//break;
-        //	}
-        //}
-        //printf("Violations  %llu\n", violations);
     }
-    printf("> merged in %.3f sec, speed %.1f M/sec \n,", time, (double)n_tot * repeat / el / 1e3);
+    printf("> %-10s merged in %.3f ms, speed %.1f M/sec\n", "parallel", el / repeat, (double)n_tot * repeat / el / 1e3);
 
     VFREE(A);
     VFREE(C);
 }
 
+void StableSort(uint64_t n) {
+    printf("---------------------------------\n");
+    printf("Stable key-value sort, n: %llu\n", n);
+
+    // few distinct keys, so that stability matters
+    std::mt19937 g;
+    std::uniform_int_distribution<Key> d(0, (Key)(n / 16));
+    Key* K = new Key[n];
+    Key* K_copy = new Key[n];
+    uint32_t* V = new uint32_t[n];
+    std::pair<Key, uint32_t>* P = new std::pair<Key, uint32_t>[n];
+    FOR(i, n, 1) K_copy[i] = d(g);
+
+    const int repeat = 10;
+    hrc::time_point st, en; double el = 0, el_par = 0, el_std = 0;
+    FOR(i, repeat, 1) {
+        memcpy(K, K_copy, n * Keysize);
+        FOR(j, n, 1) V[j] = (uint32_t)j;
+        st = hrc::now();
+        aspas::sort_stable(K, V, (uint32_t)n);
+        en = hrc::now();
+        el += ELAPSED_MS(st, en);
+
+        memcpy(K, K_copy, n * Keysize);
+        FOR(j, n, 1) V[j] = (uint32_t)j;
+        st = hrc::now();
+        aspas::parallel_sort_stable(K, V, (uint32_t)n);
+        en = hrc::now();
+        el_par += ELAPSED_MS(st, en);
+
+        FOR(j, n, 1) P[j] = std::make_pair(K_copy[j], (uint32_t)j);
+        st = hrc::now();
+        std::stable_sort(P, P + n, [](const std::pair<Key, uint32_t>& a, const std::pair<Key, uint32_t>& b) { return a.first < b.first; });
+        en = hrc::now();
+        el_std += ELAPSED_MS(st, en);
+    }
+
+    FOR(j, n, 1) {
+        if (K[j] != P[j].first || V[j] != P[j].second) {
+            printf("Incorrect @ idx %llu\n", j);
+            break;
+        }
+    }
+    printf("> %-16s %.2f ms/iter\n", "sort_stable", el / repeat);
+    printf("> %-16s %.2f ms/iter\n", "parallel", el_par / repeat);
+    printf("> %-16s %.2f ms/iter\n", "std::stable_sort", el_std / repeat);
+
+    delete[] K;
+    delete[] K_copy;
+    delete[] V;
+    delete[] P;
+}
+
 int main()
 {
     SetThreadAffinityMask(GetCurrentThread(), 1 << 4);
+
+    // machine-specific merger block sizes: autotune once per machine class, then load
+    //aspas::autotune("aspas.cfg");
+    aspas::load_tuning("aspas.cfg");
     
     // in-cache
     /*FOR_INIT(i, 3, 18, 1)
@@ -154,6 +236,7 @@ int main()
 
     /*merge_test();
     merge_test(true);*/
+    //StableSort(1LLU << 24);
 
     // out-of-cache
     /*FOR_INIT(i, 17, 29, 1)
@@ -0,0 +1,346 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file aggregate.h
+ * Definition of the sort-based group-by. The keys are folded with their
+ * position into combined keys (stable.h) and sorted by the double kernels;
+ * the last merge pass hands its tiles to a sink that fetches the value of
+ * every position and reduces the runs of equal keys, so only the groups
+ * are ever stored. Where sort() would take the radix engine, the combined
+ * keys are radix sorted and reduced after. The parallel version aggregates
+ * a part per thread and k-way merges the partial groups through the sink.
+ *
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+
+#include "aspas.h"
+
+namespace aspas
+{
+
+    /// reduction of the values of a group by sort_aggregate()
+    enum class aggregate_op : std::int8_t
+    {
+        SUM,
+        COUNT,
+        MIN,
+        MAX
+    };
+
+    namespace internal
+    {
+
+        /// positions between a value's prefetch and its fetch by the reduction
+        const uint32_t aggregate_prefetch = 16;
+
+        /// fewest elements per thread for parallel_sort_aggregate()
+        const uint32_t aggregate_parallel_min = 1 << 16;
+
+        /**
+         * The reduction in progress: the values by position, and the group
+         * being reduced, stored to out_keys and out_values once its run of
+         * combined keys ends.
+         */
+        template <class K, class V>
+        struct aggregate_state
+        {
+            const V* values;
+            aggregate_op op;
+            uint32_t shift;
+            K* out_keys;
+            V* out_values;
+            uint32_t groups;
+            uint64_t key;
+            V acc;
+            bool any;
+        };
+
+        /**
+         * This method returns the aggregate of a group of one value.
+         *
+         */
+        template <class V>
+        V aggregate_first(aggregate_op op, V v)
+        {
+            return op == aggregate_op::COUNT ? (V)1 : v;
+        }
+
+        /**
+         * This method returns the aggregate acc extended by the value v.
+         *
+         */
+        template <class V>
+        V aggregate_next(aggregate_op op, V acc, V v)
+        {
+            switch (op)
+            {
+            case aggregate_op::SUM:
+                return acc + v;
+            case aggregate_op::COUNT:
+                return acc + 1;
+            case aggregate_op::MIN:
+                return v < acc ? v : acc;
+            default:
+                return acc < v ? v : acc;
+            }
+        }
+
+        /**
+         * This method stores the group being reduced, if any.
+         *
+         */
+        template <class K, class V>
+        void aggregate_flush(aggregate_state<K, V>& s)
+        {
+            if (!s.any)
+                return;
+            stable_unkey((uint32_t)s.key, s.out_keys[s.groups]);
+            s.out_values[s.groups++] = s.acc;
+            s.any = false;
+        }
+
+        /**
+         * This method reduces the sorted combined keys[0..n) into the groups
+         * of s, continuing the group of the call before. The values are
+         * prefetched aggregate_prefetch positions ahead.
+         *
+         */
+        template <class K, class V>
+        void aggregate_fold(aggregate_state<K, V>& s, const uint64_t* keys, uint32_t n)
+        {
+            const uint64_t mask = (1ull << s.shift) - 1;
+            for (uint32_t p = 0; p < n; p++)
+            {
+                if (p + aggregate_prefetch < n)
+                    _mm_prefetch((const char*)(s.values + (keys[p + aggregate_prefetch] & mask)), _MM_HINT_T0);
+                uint64_t c = keys[p];
+                uint64_t key = c >> s.shift;
+                V v = s.values[c & mask];
+                if (s.any && key == s.key)
+                    s.acc = aggregate_next(s.op, s.acc, v);
+                else
+                {
+                    aggregate_flush(s);
+                    s.key = key;
+                    s.acc = aggregate_first(s.op, v);
+                    s.any = true;
+                }
+            }
+        }
+
+        /**
+         * The sink of the last merge pass: the merged doubles are the
+         * combined keys.
+         *
+         */
+        template <class K, class V>
+        void aggregate_sink(const void* keys, uint32_t n, void* state)
+        {
+            aggregate_fold(*(aggregate_state<K, V>*)state, (const uint64_t*)keys, n);
+        }
+
+        /**
+         * This method groups keys[0..size) and reduces the values of every
+         * group with op into out_keys and out_values. On the merge engine the
+         * reduction is the sink of the last merge pass; on the radix engine,
+         * and past stable_max elements, the combined keys are radix sorted
+         * and reduced in a pass of their own.
+         *
+         * @return the number of groups
+         *
+         */
+        template <class K, class V>
+        uint32_t aggregate_range(const K* keys, const V* values, uint32_t size, aggregate_op op, K* out_keys, V* out_values)
+        {
+            if (size == 0)
+                return 0;
+            aggregate_state<K, V> s;
+            s.values = values;
+            s.op = op;
+            s.out_keys = out_keys;
+            s.out_values = out_values;
+            s.groups = 0;
+            s.any = false;
+
+            // the combined keys take the radix engine where sort() would, as in try_radix_sort()
+            bool radix = size > stable_max || sort_engine_mode == sort_engine::RADIX ||
+                (sort_engine_mode == sort_engine::AUTO && size >= radix_min_size);
+            uint64_t* combined = (uint64_t*)_mm_malloc(sizeof(uint64_t) * size, 64);
+            if (radix)
+            {
+                s.shift = 32;
+                stable_pack(keys, 0, size, 0, s.shift, combined);
+                radix_sort(combined, size);
+                aggregate_fold(s, combined, size);
+            }
+            else
+            {
+                s.shift = stable_index_bits;
+                stable_pack(keys, 0, size, 0, s.shift, combined);
+                double* lanes = (double*)combined;
+                sorter(lanes, size);
+                merger(lanes, size, merge_tail(aggregate_sink<K, V>, &s));
+            }
+            aggregate_flush(s);
+            _mm_free(combined);
+            return s.groups;
+        }
+
+        template <class K, class V>
+        struct args_aggregate
+        {
+            const K* keys;
+            const V* values;
+            aggregate_op op;
+            K* out_keys;
+            V* out_values;
+            uint32_t begin;
+            uint32_t end;
+            uint32_t groups;
+        };
+
+        template <class K, class V>
+        void thread_aggregate_kernel(void* arguments)
+        {
+            args_aggregate<K, V>* args = (args_aggregate<K, V>*)arguments;
+            args->groups = aggregate_range(args->keys + args->begin, args->values + args->begin, args->end - args->begin,
+                args->op, args->out_keys + args->begin, args->out_values + args->begin);
+        }
+
+        /**
+         * This method aggregates with the given number of threads: every
+         * thread aggregates an equal part into the same place of a partial
+         * array, and the sorted partial groups are k-way merged into the
+         * output with the reduction as sink. Partial counts are summed.
+         *
+         * @return the number of groups
+         *
+         */
+        template <class K, class V>
+        uint32_t sort_aggregate(const K* keys, const V* values, uint32_t size, aggregate_op op, K* out_keys, V* out_values,
+            uint32_t threads)
+        {
+            threads = (std::max)((std::min)(threads, size / aggregate_parallel_min), (uint32_t)1);
+            if (threads == 1 || size > stable_max)
+                return aggregate_range(keys, values, size, op, out_keys, out_values);
+
+            K* part_keys = new K[size];
+            V* part_values = new V[size];
+            std::thread* workers = new std::thread[threads];
+            args_aggregate<K, V>* args = new args_aggregate<K, V>[threads];
+            for (uint32_t t = 0; t < threads; t++)
+            {
+                args[t].keys = keys;
+                args[t].values = values;
+                args[t].op = op;
+                args[t].out_keys = part_keys;
+                args[t].out_values = part_values;
+                args[t].begin = (uint32_t)((uint64_t)size * t / threads);
+                args[t].end = (uint32_t)((uint64_t)size * (t + 1) / threads);
+                workers[t] = std::thread(thread_aggregate_kernel<K, V>, &args[t]);
+            }
+            for (uint32_t t = 0; t < threads; t++)
+                workers[t].join();
+
+            // the partial groups of a thread are a sorted run of combined keys
+            uint64_t* combined = (uint64_t*)_mm_malloc(sizeof(uint64_t) * size, 64);
+            double** runs = new double*[threads];
+            uint32_t* lens = new uint32_t[threads];
+            for (uint32_t t = 0; t < threads; t++)
+            {
+                stable_pack(part_keys + args[t].begin, 0, args[t].groups, args[t].begin, stable_index_bits, combined + args[t].begin);
+                runs[t] = (double*)(combined + args[t].begin);
+                lens[t] = args[t].groups;
+            }
+
+            aggregate_state<K, V> s;
+            s.values = part_values;
+            s.op = op == aggregate_op::COUNT ? aggregate_op::SUM : op;
+            s.shift = stable_index_bits;
+            s.out_keys = out_keys;
+            s.out_values = out_values;
+            s.groups = 0;
+            s.any = false;
+            kway_merge_decode(runs, lens, threads, (double*)nullptr, false, merge_tail(aggregate_sink<K, V>, &s));
+            aggregate_flush(s);
+
+            delete[] lens;
+            delete[] runs;
+            _mm_free(combined);
+            delete[] args;
+            delete[] workers;
+            delete[] part_values;
+            delete[] part_keys;
+            return s.groups;
+        }
+
+    }
+
+    /**
+     * This method groups the given key-value arrays by key and reduces the values of every
+     * group, as GROUP BY key with SUM, COUNT, MIN or MAX does. The keys are sorted with
+     * their positions attached and the values are fetched by position as the groups are
+     * reduced, so the sorted values are never stored. On the merge engine (sort_engine_mode)
+     * the groups are reduced as the last merge pass produces them, without storing the
+     * sorted keys either. Currently the keys can be of the type of int, uint32_t, and float (grouped in
+     * IEEE total order, so -0 and +0 are different groups); the values can be of any
+     * arithmetic type, which the aggregates are also computed in.
+     *
+     * @param keys the pointer to the first key
+     * @param values the pointer to the first value
+     * @param size the number of elements
+     * @param op the reduction of the values of a group; COUNT ignores the values
+     * @param out_keys the saving target of the distinct keys in ascending order, room for
+     * size keys
+     * @param out_values the saving target of the aggregate of every key, room for size values
+     * @return the number of groups
+     *
+     */
+     //! This method groups the given key-value arrays by key and aggregates the values.
+    template <class K, class V>
+    uint32_t sort_aggregate(const K* keys, const V* values, uint32_t size, aggregate_op op, K* out_keys, V* out_values)
+    {
+        return internal::aggregate_range(keys, values, size, op, out_keys, out_values);
+    }
+
+    /**
+     * This method groups the given key-value arrays by key and reduces the values of every
+     * group like sort_aggregate(), with thread_num threads: each aggregates a part of the
+     * input, and the partial aggregates are merged.
+     *
+     * @param keys the pointer to the first key
+     * @param values the pointer to the first value
+     * @param size the number of elements
+     * @param op the reduction of the values of a group
+     * @param out_keys the saving target of the distinct keys, room for size keys
+     * @param out_values the saving target of the aggregate of every key, room for size values
+     * @return the number of groups
+     *
+     */
+     //! This method groups the given key-value arrays by key and aggregates the values with multiple threads.
+    template <class K, class V>
+    uint32_t parallel_sort_aggregate(const K* keys, const V* values, uint32_t size, aggregate_op op, K* out_keys, V* out_values)
+    {
+        return internal::sort_aggregate(keys, values, size, op, out_keys, out_values, thread_num);
+    }
+
+}
@@ -35,12 +35,29 @@ namespace aspas
     /// thread_num is set to be the value of the logical cores of the current platform.
     uint32_t thread_num = 16;       //sysconf(_SC_NPROCESSORS_ONLN);
 
-   
 
+    namespace internal
+    {
+        /// detect presorted runs in sort(); false sorts the whole input with sort_direct()
+        bool natural_runs = true;
+
+        template <class T>
+        void natural_sort(T* array, uint32_t size);
+
+        template <class T>
+        void sort_direct(T* array, uint32_t size);
+
+        template <class T>
+        void parallel_inplace(T* a, uint64_t n, uint32_t threads);
+
+        template <class T>
+        void parallel_sort_bounded(T* array, uint32_t size, uint32_t threads);
+    }
 
     /**
      * This method sorts the given input array. Currently the input array can be of the type
-     * of int, float, and double.
+     * of int, float, and double. Ascending and descending runs already present in the
+     * input are kept and merged, so sorted or reverse-sorted input costs one pass.
      *
      * @param array the pointer to the first element of the input array
      * @param size the size of the input array
@@ -51,8 +68,12 @@ namespace aspas
     template <class T>
     __forceinline void sort(T* array, uint32_t size)
     {
-        internal::sorter(array, size);
-        internal::merger(array, size);
+        if (internal::natural_runs)
+        {
+            internal::natural_sort(array, size);
+            return;
+        }
+        internal::sort_direct(array, size);
     }
 
   
@@ -107,6 +128,126 @@ namespace aspas
     typename std::enable_if<std::is_same<T, double>::value>::type*/
         void merge(double* inputA, uint32_t sizeA, double* inputB, uint32_t sizeB, double* output);
 
+    /**
+     * This method merges k sorted runs into one array in a single pass over
+     * the data, through a tree of SIMD merge nodes. Currently the runs can be
+     * of the type of int, float, and double.
+     *
+     * @param runs pointers to the first element of each sorted run
+     * @param lens the size of each run
+     * @param k the number of runs
+     * @param out the saving target of the merged array
+     * @return
+     *
+     */
+     //! This method merges k sorted input arrays into one.
+    template <class T>
+    void merge_k(const T* const* runs, const size_t* lens, size_t k, T* out)
+    {
+        uint64_t total = 0;
+        for (size_t i = 0; i < k; i++)
+            total += lens[i];
+
+        internal::kway_merge(const_cast<T* const*>(runs), lens, (uint32_t)k, out,
+            2 * total * sizeof(T) > util::llc_size());
+    }
+
+
+    namespace internal
+    {
+        /// shortest stretch merge_adaptive() block-copies instead of merging
+        uint32_t gallop_min = 64;
+
+        /// elements per input merge_adaptive() hands to the SIMD kernel at once
+        uint32_t gallop_window = 4096;
+
+        /**
+         * This method counts the leading elements of p that are below x
+         * (strict) or not above x, with an exponential search followed by a
+         * binary search, so a stretch of length r costs O(log r).
+         *
+         */
+        template <class T>
+        uint32_t gallop(const T* p, uint32_t n, T x, bool strict)
+        {
+            uint64_t bound = 1;
+            while (bound <= n && (strict ? p[bound - 1] < x : p[bound - 1] <= x))
+                bound *= 2;
+
+            const T* first = p + bound / 2;
+            const T* last = p + (std::min)(bound - 1, (uint64_t)n);
+            if (strict)
+                return (uint32_t)(std::lower_bound(first, last, x) - p);
+            return (uint32_t)(std::upper_bound(first, last, x) - p);
+        }
+    }
+
+    /**
+     * This method merges two sorted input arrays and adapts to their overlap.
+     * Stretches of one input that lie entirely below the next element of the
+     * other are found by galloping and block-copied; the interleaved parts
+     * are merged window by window with the SIMD merge kernel. Skewed and
+     * nearly disjoint merges run at copy speed.
+     *
+     * @param inputA the first sorted array
+     * @param sizeA the size of the first array
+     * @param inputB the second sorted array
+     * @param sizeB the size of the second array
+     * @param output the saving target of the merged array
+     * @return
+     *
+     */
+     //! This method merges two sorted input arrays into one, copying non-overlapping stretches.
+    template <class T>
+    void merge_adaptive(T* inputA, uint32_t sizeA, T* inputB, uint32_t sizeB, T* output)
+    {
+        bool stream = 2 * ((uint64_t)sizeA + sizeB) * sizeof(T) > util::llc_size();
+        uint32_t ia = 0, ib = 0;
+        uint64_t io = 0;
+
+        while (ia < sizeA && ib < sizeB)
+        {
+            uint32_t na = sizeA - ia;
+            uint32_t nb = sizeB - ib;
+            uint32_t run;
+
+            // A goes first on ties, so its stretch takes the elements equal to B[ib]
+            if (na >= internal::gallop_min && inputA[ia + internal::gallop_min - 1] <= inputB[ib])
+            {
+                run = internal::gallop(inputA + ia, na, inputB[ib], false);
+                util::copy_stream(output + io, inputA + ia, run, stream);
+                ia += run;
+                io += run;
+                continue;
+            }
+            if (nb >= internal::gallop_min && inputB[ib + internal::gallop_min - 1] < inputA[ia])
+            {
+                run = internal::gallop(inputB + ib, nb, inputA[ia], true);
+                util::copy_stream(output + io, inputB + ib, run, stream);
+                ib += run;
+                io += run;
+                continue;
+            }
+
+            // interleaved: merge one window, cut where both sides are known
+            uint32_t ca = (std::min)(na, internal::gallop_window);
+            uint32_t cb = (std::min)(nb, internal::gallop_window);
+            bool a_all = ca == na;
+            bool b_all = cb == nb;
+            if (!a_all && (b_all || inputA[ia + ca - 1] <= inputB[ib + cb - 1]))
+                cb = (uint32_t)(std::upper_bound(inputB + ib, inputB + ib + cb, inputA[ia + ca - 1]) - (inputB + ib));
+            else if (!b_all)
+                ca = (uint32_t)(std::upper_bound(inputA + ia, inputA + ia + ca, inputB[ib + cb - 1]) - (inputA + ia));
+
+            merge(inputA + ia, ca, inputB + ib, cb, output + io, stream);
+            ia += ca;
+            ib += cb;
+            io += ca + cb;
+        }
+        util::copy_stream(output + io, inputA + ia, sizeA - ia, stream);
+        io += sizeA - ia;
+        util::copy_stream(output + io, inputB + ib, sizeB - ib, stream);
+    }
 
 
     //////////////// parallel sort stuff
@@ -299,9 +440,477 @@ namespace aspas
             args->startB[tid + 1] = indB + 1;
         }
    
+        template<class T>
+        struct args_kway
+        {
+            uint32_t tid;
+            uint32_t factor;
+            size_t k;
+            const T* const* runs;
+            const size_t* lens;
+            uint64_t total;
+            T* output;
+        };
+
+        /**
+         * This method finds the co-ranks of the kth element over k sorted runs:
+         * split[i] elements are taken from run i, the split positions add up to
+         * kth, and no element left of a split is larger than one right of any
+         * split. Pivots are taken from the middle of the widest remaining
+         * window, so every round at least halves one window.
+         *
+         * @param runs the sorted runs
+         * @param lens the size of each run
+         * @param k the number of runs
+         * @param kth the number of elements left of the splits
+         * @param split output, k split positions
+         *
+         */
+        template<typename iT>
+        void find_kth_multi(const iT* const* runs, const size_t* lens, size_t k, uint64_t kth, size_t* split)
+        {
+            size_t* lo = new size_t[k];
+            size_t* hi = new size_t[k];
+            size_t* lt = new size_t[k];
+            size_t* le = new size_t[k];
+            uint64_t total = 0;
+            for (size_t i = 0; i < k; i++)
+            {
+                lo[i] = 0;
+                hi[i] = lens[i];
+                total += lens[i];
+            }
+
+            if (kth == 0 || kth >= total)
+            {
+                for (size_t i = 0; i < k; i++)
+                    split[i] = kth == 0 ? 0 : lens[i];
+            }
+            else
+            {
+                while (true)
+                {
+                    // pivot: middle of the widest window
+                    size_t w = 0;
+                    for (size_t i = 1; i < k; i++)
+                    {
+                        if (hi[i] - lo[i] > hi[w] - lo[w])
+                            w = i;
+                    }
+                    iT pivot = runs[w][lo[w] + (hi[w] - lo[w]) / 2];
+
+                    uint64_t rank_lt = 0, rank_le = 0;
+                    for (size_t i = 0; i < k; i++)
+                    {
+                        lt[i] = std::lower_bound(runs[i] + lo[i], runs[i] + hi[i], pivot) - runs[i];
+                        le[i] = std::upper_bound(runs[i] + lt[i], runs[i] + hi[i], pivot) - runs[i];
+                        rank_lt += lt[i];
+                        rank_le += le[i];
+                    }
+
+                    if (kth <= rank_lt)
+                    {
+                        for (size_t i = 0; i < k; i++)
+                            hi[i] = lt[i];
+                    }
+                    else if (kth > rank_le)
+                    {
+                        for (size_t i = 0; i < k; i++)
+                            lo[i] = le[i];
+                    }
+                    else
+                    {
+                        // the kth element equals the pivot: hand out the ties in run order
+                        uint64_t ties = kth - rank_lt;
+                        for (size_t i = 0; i < k; i++)
+                        {
+                            size_t take = (size_t)(std::min)(ties, (uint64_t)(le[i] - lt[i]));
+                            split[i] = lt[i] + take;
+                            ties -= take;
+                        }
+                        break;
+                    }
+                }
+            }
+
+            delete[] lo;
+            delete[] hi;
+            delete[] lt;
+            delete[] le;
+        }
+
+        template<class T>
+        void thread_kway_kernel(void* arguments)
+        {
+            args_kway<T>* args = (args_kway<T>*)arguments;
+            size_t k = args->k;
+
+            uint64_t first = args->total * args->tid / args->factor;
+            uint64_t last = args->total * (args->tid + 1) / args->factor;
+
+            size_t* start = new size_t[k];
+            size_t* end = new size_t[k];
+            T** runs = new T*[k];
+            size_t* lens = new size_t[k];
+            find_kth_multi(args->runs, args->lens, k, first, start);
+            find_kth_multi(args->runs, args->lens, k, last, end);
+            for (size_t i = 0; i < k; i++)
+            {
+                runs[i] = const_cast<T*>(args->runs[i]) + start[i];
+                lens[i] = end[i] - start[i];
+            }
+
+            internal::kway_merge(runs, lens, (uint32_t)k, args->output + first,
+                2 * (last - first) * sizeof(T) > util::llc_size());
+
+            delete[] start;
+            delete[] end;
+            delete[] runs;
+            delete[] lens;
+        }
+
+        /**
+         * This method merges k sorted runs with several threads. The output is
+         * cut into equal parts, the co-ranks of every cut are found with
+         * find_kth_multi and each thread k-way merges its part.
+         *
+         * @param runs pointers to the first element of each sorted run
+         * @param lens the size of each run
+         * @param k the number of runs
+         * @param out the saving target of the merged array
+         * @param threads the number of threads to use
+         *
+         */
+         //! This method merges k sorted input arrays into one with multiple threads.
+        template <class T>
+        void parallel_merge_k(const T* const* runs, const size_t* lens, size_t k, T* out, uint32_t threads = thread_num)
+        {
+            uint64_t total = 0;
+            for (size_t i = 0; i < k; i++)
+                total += lens[i];
+
+            std::thread** workers = new std::thread*[threads];
+            args_kway<T>* thread_args = new args_kway<T>[threads];
+            for (uint32_t i = 0; i < threads; i++)
+            {
+                thread_args[i].tid = i;
+                thread_args[i].factor = threads;
+                thread_args[i].k = k;
+                thread_args[i].runs = runs;
+                thread_args[i].lens = lens;
+                thread_args[i].total = total;
+                thread_args[i].output = out;
+                workers[i] = new std::thread(thread_kway_kernel<T>, &thread_args[i]);
+            }
+
+            for (uint32_t i = 0; i < threads; i++)
+                workers[i]->join();
+            for (uint32_t i = 0; i < threads; i++)
+                delete workers[i];
+
+            delete[] workers;
+            delete[] thread_args;
+        }
+
+        template<class T>
+        struct args_merge
+        {
+            uint32_t tid;
+            uint32_t factor;
+            T* inputA;
+            uint32_t sizeA;
+            T* inputB;
+            uint32_t sizeB;
+            T* output;
+        };
+
+        /**
+         * This method finds the co-ranks of the kth merged element: ia elements
+         * of inputA and ib elements of inputB, with ia + ib == kth, form the
+         * first kth elements of the merged output.
+         *
+         */
+        template<class T>
+        void find_corank(T* inputA, uint32_t sizeA, T* inputB, uint32_t sizeB, uint32_t kth, uint32_t& ia, uint32_t& ib)
+        {
+            int indA, indB;
+
+            if (kth == 0)
+            {
+                ia = 0;
+                ib = 0;
+                return;
+            }
+            find_kth2(inputA, inputA + sizeA, inputB, inputB + sizeB, (int)kth, indA, indB);
+            ia = indA + 1;
+            ib = indB + 1;
+        }
+
+        template<class T>
+        void thread_parallel_merge_kernel(void* arguments)
+        {
+            args_merge<T>* args = (args_merge<T>*)arguments;
+
+            uint64_t total = (uint64_t)args->sizeA + args->sizeB;
+            uint32_t first = (uint32_t)(total * args->tid / args->factor);
+            uint32_t last = (uint32_t)(total * (args->tid + 1) / args->factor);
+            uint32_t a0, b0, a1, b1;
+
+            find_corank(args->inputA, args->sizeA, args->inputB, args->sizeB, first, a0, b0);
+            find_corank(args->inputA, args->sizeA, args->inputB, args->sizeB, last, a1, b1);
+
+            merge(args->inputA + a0, a1 - a0, args->inputB + b0, b1 - b0, args->output + first,
+                2 * (uint64_t)(last - first) * sizeof(T) > util::llc_size());
+        }
+
+        /**
+         * This method merges two sorted input arrays with several threads. The
+         * output is cut into equal parts, the co-ranks of every cut are found
+         * with find_kth2 (merge path) and each thread runs the SIMD merge
+         * kernel on its part.
+         *
+         * @param inputA the first sorted array
+         * @param sizeA the size of the first array
+         * @param inputB the second sorted array
+         * @param sizeB the size of the second array
+         * @param output the saving target of the merged array
+         * @param threads the number of threads to use
+         *
+         */
+         //! This method merges two sorted input arrays into one with multiple threads.
+        template <class T>
+        void parallel_merge(T* inputA, uint32_t sizeA, T* inputB, uint32_t sizeB, T* output, uint32_t threads = thread_num)
+        {
+            std::thread** workers = new std::thread*[threads];
+            args_merge<T>* thread_args = new args_merge<T>[threads];
+            for (uint32_t i = 0; i < threads; i++)
+            {
+                thread_args[i].tid = i;
+                thread_args[i].factor = threads;
+                thread_args[i].inputA = inputA;
+                thread_args[i].sizeA = sizeA;
+                thread_args[i].inputB = inputB;
+                thread_args[i].sizeB = sizeB;
+                thread_args[i].output = output;
+                workers[i] = new std::thread(thread_parallel_merge_kernel<T>, &thread_args[i]);
+            }
+
+            for (uint32_t i = 0; i < threads; i++)
+                workers[i]->join();
+            for (uint32_t i = 0; i < threads; i++)
+                delete workers[i];
+
+            delete[] workers;
+            delete[] thread_args;
+        }
+
+        /// strategy of parallel_sort()
+        enum class parallel_strategy : std::int8_t
+        {
+            MERGE_TREE, ///< per-thread sort, then log2(thread_num) global merge levels
+            SAMPLE,     ///< sample sort: one partition pass, then one sort per bucket
+            IN_PLACE    ///< vectorized quicksort, no size-element buffer
+        };
+
+        /// strategy used by parallel_sort(); MERGE_TREE unless set by the caller
+        parallel_strategy parallel_sort_mode = parallel_strategy::MERGE_TREE;
+
+        /// keys sampled per bucket by sample_sort() to pick the splitters
+        uint32_t sample_oversampling = 64;
+
+        template<class T>
+        struct args_sample
+        {
+            uint32_t tid;
+            uint32_t start;
+            uint32_t end;
+            uint32_t buckets;
+            const T* splitters;
+            T* input;
+            T* output;
+            uint16_t* oracle;
+            uint32_t* count;
+            const uint32_t* bucket_start;
+        };
+
+        template<class T>
+        void thread_classify_kernel(void* arguments)
+        {
+            args_sample<T>* args = (args_sample<T>*)arguments;
+            const T* splitters = args->splitters;
+            uint32_t last = args->buckets - 1;
+
+            // branch-free binary search over the splitters padded to 2^levels - 1
+            uint32_t span = 1;
+            while (span < args->buckets)
+                span *= 2;
+
+            for (uint32_t b = 0; b < args->buckets; b++)
+                args->count[b] = 0;
+            for (uint32_t i = args->start; i < args->end; i++)
+            {
+                T x = args->input[i];
+                uint32_t b = 0;
+                for (uint32_t step = span / 2; step > 0; step /= 2)
+                    b += x >= splitters[b + step - 1] ? step : 0;
+                // only the padding, a copy of the largest sample, lies past last
+                b = (std::min)(b, last);
+                args->oracle[i] = (uint16_t)b;
+                args->count[b]++;
+            }
+        }
+
+        template<class T>
+        void thread_scatter_kernel(void* arguments)
+        {
+            args_sample<T>* args = (args_sample<T>*)arguments;
+
+            // count holds this thread's write position in every bucket by now
+            for (uint32_t i = args->start; i < args->end; i++)
+                args->output[args->count[args->oracle[i]]++] = args->input[i];
+        }
+
+        template<class T>
+        void thread_bucket_kernel(void* arguments)
+        {
+            args_sample<T>* args = (args_sample<T>*)arguments;
+            uint32_t start = args->bucket_start[args->tid];
+            uint32_t end = args->bucket_start[args->tid + 1];
+
+            sort<T>(args->output + start, end - start);
+            util::copy_stream(args->input + start, args->output + start, end - start,
+                2 * (uint64_t)(end - start) * sizeof(T) > util::llc_size());
+        }
+
+        /**
+         * This method sorts the input array by sample sort. A sorted sample
+         * gives threads - 1 splitters; every thread classifies its chunk
+         * against them and scatters it into the buckets (one pass over the
+         * data), then every thread sorts one bucket with sort() and copies it
+         * back. Unlike the merge tree, the data crosses memory about twice
+         * regardless of the number of threads.
+         *
+         * @param array the pointer to the first element of the input array
+         * @param size the size of the input array
+         * @param threads the number of threads (and buckets) to use
+         *
+         */
+        template <class T>
+        void sample_sort(T* array, uint32_t size, uint32_t threads)
+        {
+            // bucket numbers are kept in 16 bits
+            threads = (std::min)(threads, (uint32_t)65536);
+            uint32_t n_sample = threads * sample_oversampling;
+            if (threads < 2 || size < 2 * (uint64_t)n_sample)
+            {
+                sort<T>(array, size);
+                return;
+            }
+
+            // one key from every stretch of size / n_sample, jittered inside it
+            T* sample = new T[n_sample];
+            uint32_t gap = size / n_sample;
+            uint32_t seed = size;
+            for (uint32_t i = 0; i < n_sample; i++)
+            {
+                seed = seed * 1664525u + 1013904223u;
+                sample[i] = array[(uint64_t)i * gap + (seed >> 8) % gap];
+            }
+            sort<T>(sample, n_sample);
+
+            uint32_t span = 1;
+            while (span < threads)
+                span *= 2;
+            T* splitters = new T[span];
+            for (uint32_t i = 0; i < span; i++)
+                splitters[i] = i < threads - 1 ? sample[(i + 1) * sample_oversampling] : sample[n_sample - 1];
+            delete[] sample;
+
+            T* buf = (T*)_mm_malloc(sizeof(T) * size, 64);
+            uint16_t* oracle = new uint16_t[size];
+            uint32_t* count = new uint32_t[(uint64_t)threads * threads];
+            uint32_t* bucket_start = new uint32_t[threads + 1];
+            std::thread** workers = new std::thread*[threads];
+            args_sample<T>* thread_args = new args_sample<T>[threads];
+
+            uint32_t b = size / threads;
+            uint32_t m = size % threads;
+            for (uint32_t i = 0; i < threads; i++)
+            {
+                thread_args[i].tid = i;
+                thread_args[i].start = i * b + (std::min)(i, m);
+                thread_args[i].end = thread_args[i].start + b + (i < m ? 1 : 0);
+                thread_args[i].buckets = threads;
+                thread_args[i].splitters = splitters;
+                thread_args[i].input = array;
+                thread_args[i].output = buf;
+                thread_args[i].oracle = oracle;
+                thread_args[i].count = count + (uint64_t)i * threads;
+                thread_args[i].bucket_start = bucket_start;
+                workers[i] = new std::thread(thread_classify_kernel<T>, &thread_args[i]);
+            }
+            for (uint32_t i = 0; i < threads; i++)
+                workers[i]->join();
+            for (uint32_t i = 0; i < threads; i++)
+                delete workers[i];
+
+            // bucket-major prefix sum: thread i writes bucket j after threads 0..i-1
+            uint32_t sum = 0;
+            for (uint32_t j = 0; j < threads; j++)
+            {
+                bucket_start[j] = sum;
+                for (uint32_t i = 0; i < threads; i++)
+                {
+                    uint32_t c = count[(uint64_t)i * threads + j];
+                    count[(uint64_t)i * threads + j] = sum;
+                    sum += c;
+                }
+            }
+            bucket_start[threads] = sum;
+
+            for (uint32_t i = 0; i < threads; i++)
+                workers[i] = new std::thread(thread_scatter_kernel<T>, &thread_args[i]);
+            for (uint32_t i = 0; i < threads; i++)
+                workers[i]->join();
+            for (uint32_t i = 0; i < threads; i++)
+                delete workers[i];
+
+            for (uint32_t i = 0; i < threads; i++)
+                workers[i] = new std::thread(thread_bucket_kernel<T>, &thread_args[i]);
+            for (uint32_t i = 0; i < threads; i++)
+                workers[i]->join();
+            for (uint32_t i = 0; i < threads; i++)
+                delete workers[i];
+
+            delete[] workers;
+            delete[] thread_args;
+            delete[] bucket_start;
+            delete[] count;
+            delete[] oracle;
+            delete[] splitters;
+            _mm_free(buf);
+        }
+
        template <class T>
         void parallel_sort(T*& array, uint32_t size)
         {
+            if (parallel_sort_mode != parallel_strategy::IN_PLACE && scratch_budget != 0 &&
+                (uint64_t)size * sizeof(T) > scratch_budget)
+            {
+                internal::parallel_sort_bounded(array, size, thread_num);
+                return;
+            }
+            if (parallel_sort_mode == parallel_strategy::SAMPLE)
+            {
+                sample_sort(array, size, thread_num);
+                return;
+            }
+            if (parallel_sort_mode == parallel_strategy::IN_PLACE)
+            {
+                internal::parallel_inplace(array, (uint64_t)size, thread_num);
+                return;
+            }
+
             std::thread** threads = new std::thread*[thread_num];
             args_t<T>* thread_args = new args_t<T>[thread_num];
 
@@ -437,6 +1046,24 @@ namespace aspas
         }
 }
 
+#include "radix.h"
+#include "inplace.h"
+#include "bounded.h"
+#include "natural.h"
+#include "select.h"
+#include "order.h"
+#include "stable.h"
+#include "records.h"
+#include "permute.h"
+#include "columns.h"
+#include "strsort.h"
+#include "indirect.h"
+#include "unique.h"
+#include "sets.h"
+#include "join.h"
+#include "aggregate.h"
+#include "tuning.h"
+
 //#include "aspas.hpp"
 
 
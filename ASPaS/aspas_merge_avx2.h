@@ -25,6 +25,26 @@
 
 namespace aspas
 {
+    /**
+     * Selects the main loop of merge(). AUTO probes the first merge_probe_steps
+     * vectors and switches to the branch-free loop when the inputs interleave.
+     */
+    enum class merge_loop : std::int8_t
+    {
+        AUTO,
+        BRANCHY,
+        BRANCHLESS
+    };
+
+    /// main loop policy of merge(), AUTO by default
+    merge_loop merge_loop_mode = merge_loop::AUTO;
+
+    /// number of vector steps merge() probes before picking its main loop
+    const uint32_t merge_probe_steps = 32;
+
+    /// distance in bytes ahead of the read positions prefetched by streaming merges
+    uint32_t merge_prefetch_distance = 1024;
+
 
     /**
      * Integer vector (__m256i) version:
@@ -167,9 +187,81 @@ namespace aspas
         v1 = _mm256_permute2f128_pd(ext1, ext2, 0x31);
     }
 
+    /**
+     * Integer version:
+     * This method stores one vector of merged output, bypassing the caches
+     * with a non-temporal store when stream is set (p must be 32-byte aligned).
+     *
+     */
+    void    store_vector(int* p, __m256i v, bool stream)
+    {
+        if (stream)
+            _mm256_stream_si256((__m256i*)p, v);
+        else
+            _mm256_storeu_si256((__m256i*)p, v);
+    }
+
+    /**
+     * Float version:
+     * This method stores one vector of merged output, bypassing the caches
+     * with a non-temporal store when stream is set (p must be 32-byte aligned).
+     *
+     */
+    void    store_vector(float* p, __m256 v, bool stream)
+    {
+        if (stream)
+            _mm256_stream_ps(p, v);
+        else
+            _mm256_storeu_ps(p, v);
+    }
+
+    /**
+     * Double version:
+     * This method stores one vector of merged output, bypassing the caches
+     * with a non-temporal store when stream is set (p must be 32-byte aligned).
+     *
+     */
+    void    store_vector(double* p, __m256d v, bool stream)
+    {
+        if (stream)
+            _mm256_stream_pd(p, v);
+        else
+            _mm256_storeu_pd(p, v);
+    }
+
+    /**
+     * This method prefetches both merge inputs merge_prefetch_distance bytes
+     * ahead of the current read positions when stream is set.
+     *
+     */
+    template <typename T>
+    void    prefetch_inputs(T* a, T* b, bool stream)
+    {
+        if (stream)
+        {
+            _mm_prefetch((const char*)a + merge_prefetch_distance, _MM_HINT_T0);
+            _mm_prefetch((const char*)b + merge_prefetch_distance, _MM_HINT_T0);
+        }
+    }
+
+    /**
+     * Integer version:
+     * This method merges two sorted input arrays pointed by inputA and inputB.
+     * With stream set (out-of-cache passes) both inputs are prefetched ahead
+     * and, if output is 32-byte aligned, the vector part of the result is
+     * written with non-temporal stores.
+     *
+     * @param inputA the first sorted array
+     * @param sizeA the size of the first array
+     * @param inputB the second sorted array
+     * @param sizeB the size of the second array
+     * @param output the saving target of the merged array
+     * @param stream enables prefetching and streaming stores
+     *
+     */
     /*template <typename T>
     typename std::enable_if<std::is_same<T, int>::value>::type*/
-    void    merge(int* inputA, uint32_t sizeA, int* inputB, uint32_t sizeB, int* output)
+    void    merge(int* inputA, uint32_t sizeA, int* inputB, uint32_t sizeB, int* output, bool stream)
     {
         __m256i vec0;
         __m256i vec1;
@@ -181,6 +273,9 @@ namespace aspas
         int buffer[stride];
         uint32_t i3 = 0;
 
+        // non-temporal stores need an aligned destination
+        stream = stream && ((uintptr_t)output & 31) == 0;
+
         if (sizeA >= stride && sizeB >= stride)
         {
             vec0 = _mm256_loadu_si256((__m256i*)inputA);
@@ -188,13 +283,62 @@ namespace aspas
 
             in_register_merge(vec0, vec1);
 
-            _mm256_storeu_si256((__m256i*)(output + iout), vec0);
+            store_vector(output + iout, vec0, stream);
             i0 += stride;
             i1 += stride;
             iout += stride;
 
+            uint32_t steps = 0;
+            uint32_t flips = 0;
+            bool last_a = true;
+            if (merge_loop_mode == merge_loop::AUTO)
+            {
+                // probe the inputs with the branchy loop and count how often the
+                // source switches; interleaved (random) data switches about every
+                // other step, which is where the branch mispredicts
+                while (steps < merge_probe_steps && i0 + stride <= sizeA && i1 + stride <= sizeB)
+                {
+                    prefetch_inputs(inputA + i0, inputB + i1, stream);
+                    bool take_a = inputA[i0] <= inputB[i1];
+                    if (take_a)
+                    {
+                        vec0 = _mm256_loadu_si256((__m256i*)(inputA + i0));
+                        i0 += stride;
+                    }
+                    else
+                    {
+                        vec0 = _mm256_loadu_si256((__m256i*)(inputB + i1));
+                        i1 += stride;
+                    }
+                    flips += take_a != last_a;
+                    last_a = take_a;
+                    steps++;
+                    in_register_merge(vec0, vec1);
+                    store_vector(output + iout, vec0, stream);
+                    iout += stride;
+                }
+            }
+            if (merge_loop_mode == merge_loop::BRANCHLESS ||
+                (merge_loop_mode == merge_loop::AUTO && flips * 4 >= merge_probe_steps))
+            {
+                // branch-free loop: both candidates are computed and the next
+                // vector is selected with a conditional move
+                while (i0 + stride <= sizeA && i1 + stride <= sizeB)
+                {
+                    prefetch_inputs(inputA + i0, inputB + i1, stream);
+                    uint32_t take_a = inputA[i0] <= inputB[i1];
+                    int* next = take_a ? inputA + i0 : inputB + i1;
+                    vec0 = _mm256_loadu_si256((__m256i*)(next));
+                    i0 += take_a * stride;
+                    i1 += (take_a ^ 1) * stride;
+                    in_register_merge(vec0, vec1);
+                    store_vector(output + iout, vec0, stream);
+                    iout += stride;
+                }
+            }
             while (i0 + stride <= sizeA && i1 + stride <= sizeB)
             {
+                prefetch_inputs(inputA + i0, inputB + i1, stream);
                 if (inputA[i0] <= inputB[i1])
                 {
                     vec0 = _mm256_loadu_si256((__m256i*)(inputA + i0));
@@ -206,7 +350,7 @@ namespace aspas
                     i1 += stride;
                 }
                 in_register_merge(vec0, vec1);
-                _mm256_storeu_si256((__m256i*)(output + iout), vec0);
+                store_vector(output + iout, vec0, stream);
                 iout += stride;
             }
             while (i0 + stride <= sizeA)
@@ -216,7 +360,7 @@ namespace aspas
                     vec0 = _mm256_loadu_si256((__m256i*)(inputA + i0));
                     i0 += stride;
                     in_register_merge(vec0, vec1);
-                    _mm256_storeu_si256((__m256i*)(output + iout), vec0);
+                    store_vector(output + iout, vec0, stream);
                     iout += stride;
                 }
                 else
@@ -229,12 +373,14 @@ namespace aspas
                     vec0 = _mm256_loadu_si256((__m256i*)(inputB + i1));
                     i1 += stride;
                     in_register_merge(vec0, vec1);
-                    _mm256_storeu_si256((__m256i*)(output + iout), vec0);
+                    store_vector(output + iout, vec0, stream);
                     iout += stride;
                 }
                 else
                     break;
             }
+            if (stream)
+                _mm_sfence();
             _mm256_storeu_si256((__m256i*)buffer, vec1);
 
             while (i0 < sizeA && i1 < sizeB && i3 < stride)
@@ -356,9 +502,31 @@ namespace aspas
         }
     }
 
+    /*template <typename T>
+    typename std::enable_if<std::is_same<T, int>::value>::type*/
+    void    merge(int* inputA, uint32_t sizeA, int* inputB, uint32_t sizeB, int* output)
+    {
+        merge(inputA, sizeA, inputB, sizeB, output, false);
+    }
+
+    /**
+     * Float version:
+     * This method merges two sorted input arrays pointed by inputA and inputB.
+     * With stream set (out-of-cache passes) both inputs are prefetched ahead
+     * and, if output is 32-byte aligned, the vector part of the result is
+     * written with non-temporal stores.
+     *
+     * @param inputA the first sorted array
+     * @param sizeA the size of the first array
+     * @param inputB the second sorted array
+     * @param sizeB the size of the second array
+     * @param output the saving target of the merged array
+     * @param stream enables prefetching and streaming stores
+     *
+     */
     /*template <typename T>
     typename std::enable_if<std::is_same<T, float>::value>::type*/
-    void    merge(float* inputA, uint32_t sizeA, float* inputB, uint32_t sizeB, float* output)
+    void    merge(float* inputA, uint32_t sizeA, float* inputB, uint32_t sizeB, float* output, bool stream)
     {
         __m256 vec0;
         __m256 vec1;
@@ -370,6 +538,9 @@ namespace aspas
         float buffer[stride];
         uint32_t i3 = 0;
 
+        // non-temporal stores need an aligned destination
+        stream = stream && ((uintptr_t)output & 31) == 0;
+
         if (sizeA >= stride && sizeB >= stride)
         {
             vec0 = _mm256_loadu_ps(inputA);
@@ -377,13 +548,62 @@ namespace aspas
 
             in_register_merge(vec0, vec1);
 
-            _mm256_storeu_ps((output + iout), vec0);
+            store_vector(output + iout, vec0, stream);
             i0 += stride;
             i1 += stride;
             iout += stride;
 
+            uint32_t steps = 0;
+            uint32_t flips = 0;
+            bool last_a = true;
+            if (merge_loop_mode == merge_loop::AUTO)
+            {
+                // probe the inputs with the branchy loop and count how often the
+                // source switches; interleaved (random) data switches about every
+                // other step, which is where the branch mispredicts
+                while (steps < merge_probe_steps && i0 + stride <= sizeA && i1 + stride <= sizeB)
+                {
+                    prefetch_inputs(inputA + i0, inputB + i1, stream);
+                    bool take_a = inputA[i0] <= inputB[i1];
+                    if (take_a)
+                    {
+                        vec0 = _mm256_loadu_ps((inputA + i0));
+                        i0 += stride;
+                    }
+                    else
+                    {
+                        vec0 = _mm256_loadu_ps((inputB + i1));
+                        i1 += stride;
+                    }
+                    flips += take_a != last_a;
+                    last_a = take_a;
+                    steps++;
+                    in_register_merge(vec0, vec1);
+                    store_vector(output + iout, vec0, stream);
+                    iout += stride;
+                }
+            }
+            if (merge_loop_mode == merge_loop::BRANCHLESS ||
+                (merge_loop_mode == merge_loop::AUTO && flips * 4 >= merge_probe_steps))
+            {
+                // branch-free loop: both candidates are computed and the next
+                // vector is selected with a conditional move
+                while (i0 + stride <= sizeA && i1 + stride <= sizeB)
+                {
+                    prefetch_inputs(inputA + i0, inputB + i1, stream);
+                    uint32_t take_a = inputA[i0] <= inputB[i1];
+                    float* next = take_a ? inputA + i0 : inputB + i1;
+                    vec0 = _mm256_loadu_ps((next));
+                    i0 += take_a * stride;
+                    i1 += (take_a ^ 1) * stride;
+                    in_register_merge(vec0, vec1);
+                    store_vector(output + iout, vec0, stream);
+                    iout += stride;
+                }
+            }
             while (i0 + stride <= sizeA && i1 + stride <= sizeB)
             {
+                prefetch_inputs(inputA + i0, inputB + i1, stream);
                 if (inputA[i0] <= inputB[i1])
                 {
                     vec0 = _mm256_loadu_ps((inputA + i0));
@@ -395,7 +615,7 @@ namespace aspas
                     i1 += stride;
                 }
                 in_register_merge(vec0, vec1);
-                _mm256_storeu_ps((output + iout), vec0);
+                store_vector(output + iout, vec0, stream);
                 iout += stride;
             }
             while (i0 + stride <= sizeA)
@@ -405,7 +625,7 @@ namespace aspas
                     vec0 = _mm256_loadu_ps((inputA + i0));
                     i0 += stride;
                     in_register_merge(vec0, vec1);
-                    _mm256_storeu_ps((output + iout), vec0);
+                    store_vector(output + iout, vec0, stream);
                     iout += stride;
                 }
                 else
@@ -418,12 +638,14 @@ namespace aspas
                     vec0 = _mm256_loadu_ps((inputB + i1));
                     i1 += stride;
                     in_register_merge(vec0, vec1);
-                    _mm256_storeu_ps((output + iout), vec0);
+                    store_vector(output + iout, vec0, stream);
                     iout += stride;
                 }
                 else
                     break;
             }
+            if (stream)
+                _mm_sfence();
             _mm256_storeu_ps(buffer, vec1);
 
             while (i0 < sizeA && i1 < sizeB && i3 < stride)
@@ -545,9 +767,31 @@ namespace aspas
         }
     }
 
+    /*template <typename T>
+    typename std::enable_if<std::is_same<T, float>::value>::type*/
+    void    merge(float* inputA, uint32_t sizeA, float* inputB, uint32_t sizeB, float* output)
+    {
+        merge(inputA, sizeA, inputB, sizeB, output, false);
+    }
+
+    /**
+     * Double version:
+     * This method merges two sorted input arrays pointed by inputA and inputB.
+     * With stream set (out-of-cache passes) both inputs are prefetched ahead
+     * and, if output is 32-byte aligned, the vector part of the result is
+     * written with non-temporal stores.
+     *
+     * @param inputA the first sorted array
+     * @param sizeA the size of the first array
+     * @param inputB the second sorted array
+     * @param sizeB the size of the second array
+     * @param output the saving target of the merged array
+     * @param stream enables prefetching and streaming stores
+     *
+     */
     /*template <typename T>
     typename std::enable_if<std::is_same<T, double>::value>::type*/
-    void    merge(double* inputA, uint32_t sizeA, double* inputB, uint32_t sizeB, double* output)
+    void    merge(double* inputA, uint32_t sizeA, double* inputB, uint32_t sizeB, double* output, bool stream)
     {
         __m256d vec0;
         __m256d vec1;
@@ -559,6 +803,9 @@ namespace aspas
         double buffer[stride];
         uint32_t i3 = 0;
 
+        // non-temporal stores need an aligned destination
+        stream = stream && ((uintptr_t)output & 31) == 0;
+
         if (sizeA >= stride && sizeB >= stride)
         {
             vec0 = _mm256_loadu_pd(inputA);
@@ -566,13 +813,62 @@ namespace aspas
 
             in_register_merge(vec0, vec1);
 
-            _mm256_storeu_pd((output + iout), vec0);
+            store_vector(output + iout, vec0, stream);
             i0 += stride;
             i1 += stride;
             iout += stride;
 
+            uint32_t steps = 0;
+            uint32_t flips = 0;
+            bool last_a = true;
+            if (merge_loop_mode == merge_loop::AUTO)
+            {
+                // probe the inputs with the branchy loop and count how often the
+                // source switches; interleaved (random) data switches about every
+                // other step, which is where the branch mispredicts
+                while (steps < merge_probe_steps && i0 + stride <= sizeA && i1 + stride <= sizeB)
+                {
+                    prefetch_inputs(inputA + i0, inputB + i1, stream);
+                    bool take_a = inputA[i0] <= inputB[i1];
+                    if (take_a)
+                    {
+                        vec0 = _mm256_loadu_pd((inputA + i0));
+                        i0 += stride;
+                    }
+                    else
+                    {
+                        vec0 = _mm256_loadu_pd((inputB + i1));
+                        i1 += stride;
+                    }
+                    flips += take_a != last_a;
+                    last_a = take_a;
+                    steps++;
+                    in_register_merge(vec0, vec1);
+                    store_vector(output + iout, vec0, stream);
+                    iout += stride;
+                }
+            }
+            if (merge_loop_mode == merge_loop::BRANCHLESS ||
+                (merge_loop_mode == merge_loop::AUTO && flips * 4 >= merge_probe_steps))
+            {
+                // branch-free loop: both candidates are computed and the next
+                // vector is selected with a conditional move
+                while (i0 + stride <= sizeA && i1 + stride <= sizeB)
+                {
+                    prefetch_inputs(inputA + i0, inputB + i1, stream);
+                    uint32_t take_a = inputA[i0] <= inputB[i1];
+                    double* next = take_a ? inputA + i0 : inputB + i1;
+                    vec0 = _mm256_loadu_pd((next));
+                    i0 += take_a * stride;
+                    i1 += (take_a ^ 1) * stride;
+                    in_register_merge(vec0, vec1);
+                    store_vector(output + iout, vec0, stream);
+                    iout += stride;
+                }
+            }
             while (i0 + stride <= sizeA && i1 + stride <= sizeB)
             {
+                prefetch_inputs(inputA + i0, inputB + i1, stream);
                 if (inputA[i0] <= inputB[i1])
                 {
                     vec0 = _mm256_loadu_pd((inputA + i0));
@@ -584,7 +880,7 @@ namespace aspas
                     i1 += stride;
                 }
                 in_register_merge(vec0, vec1);
-                _mm256_storeu_pd((output + iout), vec0);
+                store_vector(output + iout, vec0, stream);
                 iout += stride;
             }
             while (i0 + stride <= sizeA)
@@ -594,7 +890,7 @@ namespace aspas
                     vec0 = _mm256_loadu_pd((inputA + i0));
                     i0 += stride;
                     in_register_merge(vec0, vec1);
-                    _mm256_storeu_pd((output + iout), vec0);
+                    store_vector(output + iout, vec0, stream);
                     iout += stride;
                 }
                 else
@@ -607,12 +903,14 @@ namespace aspas
                     vec0 = _mm256_loadu_pd((inputB + i1));
                     i1 += stride;
                     in_register_merge(vec0, vec1);
-                    _mm256_storeu_pd((output + iout), vec0);
+                    store_vector(output + iout, vec0, stream);
                     iout += stride;
                 }
                 else
                     break;
             }
+            if (stream)
+                _mm_sfence();
             _mm256_storeu_pd(buffer, vec1);
 
             while (i0 < sizeA && i1 < sizeB && i3 < stride)
@@ -734,4 +1032,11 @@ namespace aspas
         }
     }
 
+    /*template <typename T>
+    typename std::enable_if<std::is_same<T, double>::value>::type*/
+    void    merge(double* inputA, uint32_t sizeA, double* inputB, uint32_t sizeB, double* output)
+    {
+        merge(inputA, sizeA, inputB, sizeB, output, false);
+    }
+
 } // end namespace aspas
@@ -0,0 +1,446 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file bounded.h
+ * Definition of the merge passes used when scratch_budget is set and a
+ * size-element buffer does not fit in it. Two adjacent sorted runs are
+ * merged in place: the smaller run is moved to the bounded buffer if it
+ * fits, and the merge then writes into the room it left, one SIMD window
+ * at a time. Otherwise the runs are split at their median co-rank, the
+ * middle is rotated into place, and the halves are merged independently
+ * (in parallel when threads are available).
+ *
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+
+#include "aspas.h"
+#include "tools.h"
+
+namespace aspas
+{
+
+    namespace internal
+    {
+
+        /// a buffered merge finishes by insertion once this few keys are left in the buffer
+        const uint32_t bounded_tail = 16;
+
+        /// merges below this size are not split further across threads
+        uint32_t bounded_parallel_min = 1 << 16;
+
+        /**
+         * This method counts the trailing elements of p[0..n) that are above
+         * x (strict) or not below x, with an exponential search followed by a
+         * binary search.
+         *
+         */
+        template <class T>
+        uint32_t gallop_back(const T* p, uint32_t n, T x, bool strict)
+        {
+            uint64_t bound = 1;
+            while (bound <= n && (strict ? p[n - bound] > x : p[n - bound] >= x))
+                bound *= 2;
+
+            const T* first = p + n - (std::min)(bound - 1, (uint64_t)n);
+            const T* last = p + n - bound / 2;
+            if (strict)
+                return (uint32_t)(p + n - std::upper_bound(first, last, x));
+            return (uint32_t)(p + n - std::lower_bound(first, last, x));
+        }
+
+        /**
+         * This method merges a[0..n1) and a[n1..n1+n2) with the first run
+         * moved to buf. The output always stays below the unread part of the
+         * second run, so each SIMD window is limited to the room the first
+         * run still holds in the buffer.
+         *
+         */
+        template <class T>
+        void merge_buffered_front(T* a, uint32_t n1, uint32_t n2, T* buf)
+        {
+            T* b = a + n1;
+            uint32_t ia = 0, ib = 0;
+            uint64_t io = 0;
+
+            std::copy(a, a + n1, buf);
+            while (ia < n1 && ib < n2)
+            {
+                uint32_t na = n1 - ia;
+                uint32_t nb = n2 - ib;
+                uint32_t run;
+
+                // a stretch of the second run below buf[ia] slides down in place
+                if (nb >= gallop_min && b[ib + gallop_min - 1] < buf[ia])
+                {
+                    run = gallop(b + ib, nb, buf[ia], true);
+                    std::copy(b + ib, b + ib + run, a + io);
+                    ib += run;
+                    io += run;
+                    continue;
+                }
+                if (na >= gallop_min && buf[ia + gallop_min - 1] <= b[ib])
+                {
+                    run = gallop(buf + ia, na, b[ib], false);
+                    std::copy(buf + ia, buf + ia + run, a + io);
+                    ia += run;
+                    io += run;
+                    continue;
+                }
+                if (na <= bounded_tail)
+                {
+                    run = gallop(b + ib, nb, buf[ia], true);
+                    std::copy(b + ib, b + ib + run, a + io);
+                    ib += run;
+                    io += run;
+                    a[io++] = buf[ia++];
+                    continue;
+                }
+
+                // the window may fill the na free slots in front of b + ib
+                uint32_t ca = (std::min)(gallop_window, na / 2);
+                uint32_t cb = (std::min)((std::min)(gallop_window, nb), na - ca);
+                if (buf[ia + ca - 1] <= b[ib + cb - 1])
+                    cb = (uint32_t)(std::upper_bound(b + ib, b + ib + cb, buf[ia + ca - 1]) - (b + ib));
+                else
+                    ca = (uint32_t)(std::upper_bound(buf + ia, buf + ia + ca, b[ib + cb - 1]) - (buf + ia));
+
+                merge(buf + ia, ca, b + ib, cb, a + io);
+                ia += ca;
+                ib += cb;
+                io += ca + cb;
+            }
+            // whatever is left of the second run is already in place
+            std::copy(buf + ia, buf + n1, a + io);
+        }
+
+        /**
+         * This method merges a[0..n1) and a[n1..n1+n2) with the second run
+         * moved to buf, from the top down. Every window takes the largest
+         * keys left and is merged into the room above the unread part of the
+         * first run.
+         *
+         */
+        template <class T>
+        void merge_buffered_back(T* a, uint32_t n1, uint32_t n2, T* buf)
+        {
+            uint32_t ea = n1, eb = n2;
+            uint64_t eo = (uint64_t)n1 + n2;
+
+            std::copy(a + n1, a + n1 + n2, buf);
+            while (ea > 0 && eb > 0)
+            {
+                uint32_t run;
+
+                // a stretch of the first run above buf[eb - 1] slides up in place
+                if (ea >= gallop_min && a[ea - gallop_min] > buf[eb - 1])
+                {
+                    run = gallop_back(a, ea, buf[eb - 1], true);
+                    std::copy_backward(a + ea - run, a + ea, a + eo);
+                    ea -= run;
+                    eo -= run;
+                    continue;
+                }
+                if (eb >= gallop_min && buf[eb - gallop_min] >= a[ea - 1])
+                {
+                    run = gallop_back(buf, eb, a[ea - 1], false);
+                    std::copy(buf + eb - run, buf + eb, a + eo - run);
+                    eb -= run;
+                    eo -= run;
+                    continue;
+                }
+                if (eb <= bounded_tail)
+                {
+                    run = gallop_back(a, ea, buf[eb - 1], true);
+                    std::copy_backward(a + ea - run, a + ea, a + eo);
+                    ea -= run;
+                    eo -= run;
+                    a[--eo] = buf[--eb];
+                    continue;
+                }
+
+                // the window may fill the eb free slots above a + ea
+                uint32_t cb = (std::min)(gallop_window, eb / 2);
+                uint32_t ca = (std::min)((std::min)(gallop_window, ea), eb - cb);
+                T* wa = a + ea - ca;
+                T* wb = buf + eb - cb;
+                // keep the window whose smallest key is larger, trim the other to it
+                if (*wa >= *wb)
+                    cb = (uint32_t)(buf + eb - std::lower_bound(wb, buf + eb, *wa));
+                else
+                    ca = (uint32_t)(a + ea - std::lower_bound(wa, a + ea, *wb));
+
+                merge(a + ea - ca, ca, buf + eb - cb, cb, a + eo - ca - cb);
+                ea -= ca;
+                eb -= cb;
+                eo -= ca + cb;
+            }
+            // whatever is left of the first run is already in place
+            std::copy(buf, buf + eb, a + ea);
+        }
+
+        /**
+         * This method merges the adjacent sorted runs a[0..n1) and
+         * a[n1..n1+n2) in place using at most cap elements of buf.
+         *
+         * @param a the first run, followed by the second
+         * @param n1 the size of the first run
+         * @param n2 the size of the second run
+         * @param buf the scratch space
+         * @param cap the capacity of buf in elements
+         *
+         */
+        template <class T>
+        void merge_bounded(T* a, uint32_t n1, uint32_t n2, T* buf, uint32_t cap)
+        {
+            while (n1 != 0 && n2 != 0 && a[n1 - 1] > a[n1])
+            {
+                if (n1 <= cap && n1 <= n2)
+                {
+                    merge_buffered_front(a, n1, n2, buf);
+                    return;
+                }
+                if (n2 <= cap)
+                {
+                    merge_buffered_back(a, n1, n2, buf);
+                    return;
+                }
+                if (n1 <= cap)
+                {
+                    merge_buffered_front(a, n1, n2, buf);
+                    return;
+                }
+
+                // neither run fits: rotate the middle so the halves are independent
+                uint32_t ia, ib;
+                find_corank(a, n1, a + n1, n2, (uint32_t)(((uint64_t)n1 + n2) / 2), ia, ib);
+                std::rotate(a + ia, a + n1, a + n1 + ib);
+                merge_bounded(a, ia, ib, buf, cap);
+                a += ia + ib;
+                n1 -= ia;
+                n2 -= ib;
+            }
+        }
+
+        template<class T>
+        struct args_bounded
+        {
+            T* array;
+            uint32_t n1;
+            uint32_t n2;
+            T* buf;
+            uint32_t cap;
+            uint32_t threads;
+        };
+
+        template<class T>
+        void merge_bounded_parallel(T* a, uint32_t n1, uint32_t n2, T* buf, uint32_t cap, uint32_t threads);
+
+        template<class T>
+        void thread_bounded_kernel(void* arguments)
+        {
+            args_bounded<T>* args = (args_bounded<T>*)arguments;
+            merge_bounded_parallel(args->array, args->n1, args->n2, args->buf, args->cap, args->threads);
+        }
+
+        /**
+         * This method merges the adjacent sorted runs like merge_bounded,
+         * with up to threads threads. The runs are split at the median
+         * co-rank and rotated; the halves, each with half of the threads and
+         * of the buffer, are merged concurrently.
+         *
+         */
+        template<class T>
+        void merge_bounded_parallel(T* a, uint32_t n1, uint32_t n2, T* buf, uint32_t cap, uint32_t threads)
+        {
+            if (threads < 2 || (uint64_t)n1 + n2 < bounded_parallel_min || n1 == 0 || n2 == 0 || a[n1 - 1] <= a[n1])
+            {
+                merge_bounded(a, n1, n2, buf, cap);
+                return;
+            }
+
+            uint32_t ia, ib;
+            find_corank(a, n1, a + n1, n2, (uint32_t)(((uint64_t)n1 + n2) / 2), ia, ib);
+            std::rotate(a + ia, a + n1, a + n1 + ib);
+
+            args_bounded<T> left_args;
+            left_args.array = a;
+            left_args.n1 = ia;
+            left_args.n2 = ib;
+            left_args.buf = buf;
+            left_args.cap = cap / 2;
+            left_args.threads = threads / 2;
+            std::thread worker(thread_bounded_kernel<T>, &left_args);
+
+            merge_bounded_parallel(a + ia + ib, n1 - ia, n2 - ib, buf + cap / 2, cap - cap / 2, threads - threads / 2);
+            worker.join();
+        }
+
+        /**
+         * This method merges the sorted segments left by sorter like merger,
+         * but in place with at most cap elements of buf: the passes inside a
+         * block run first so they stay in cache (ping-ponging through buf if
+         * the block fits in it), then the outer passes.
+         *
+         * @param orig the partially sorted array
+         * @param size its size
+         * @param buf the scratch space
+         * @param cap the capacity of buf in elements
+         *
+         */
+        template <typename T>
+        void merger_bounded(T* orig, uint32_t size, T* buf, uint32_t cap)
+        {
+            uint8_t stride;
+            uint32_t way;
+            merger_params<T>(stride, way);
+            uint32_t block_size = stride * way;
+
+            for (uint32_t k = 0; k < size; k += block_size)
+            {
+                uint32_t end = (std::min)(k + block_size, size);
+                if (cap >= end - k)
+                {
+                    // the block fits in the buffer: plain ping-pong passes
+                    T* src = orig + k;
+                    T* dst = buf;
+                    for (uint32_t i = stride; i < end - k; i *= 2)
+                    {
+                        for (uint32_t j = 0; j < end - k; j += 2 * i)
+                        {
+                            uint32_t mid = (std::min)(j + i, end - k);
+                            merge(src + j, mid - j, src + mid, (std::min)(j + 2 * i, end - k) - mid, dst + j);
+                        }
+                        std::swap(src, dst);
+                    }
+                    if (src != orig + k)
+                        std::copy(src, src + (end - k), orig + k);
+                    continue;
+                }
+                for (uint32_t i = stride; i < end - k; i *= 2)
+                {
+                    for (uint32_t j = k; j < end; j += 2 * i)
+                    {
+                        uint32_t mid = (std::min)(j + i, end);
+                        merge_bounded(orig + j, mid - j, (std::min)(j + 2 * i, end) - mid, buf, cap);
+                    }
+                }
+            }
+            for (uint64_t i = block_size; i < size; i *= 2)
+            {
+                for (uint64_t j = 0; j < size; j += 2 * i)
+                {
+                    uint32_t mid = (uint32_t)(std::min)(j + i, (uint64_t)size);
+                    uint32_t end = (uint32_t)(std::min)(j + 2 * i, (uint64_t)size);
+                    merge_bounded(orig + j, mid - (uint32_t)j, end - mid, buf, cap);
+                }
+            }
+        }
+
+        template<class T>
+        struct args_chunk
+        {
+            T* array;
+            uint32_t size;
+            T* buf;
+            uint32_t cap;
+        };
+
+        template<class T>
+        void thread_chunk_kernel(void* arguments)
+        {
+            args_chunk<T>* args = (args_chunk<T>*)arguments;
+            sorter(args->array, args->size);
+            merger_bounded(args->array, args->size, args->buf, args->cap);
+        }
+
+        /**
+         * This method is parallel_sort within scratch_budget bytes: every
+         * thread sorts its chunk with its share of the buffer, then adjacent
+         * sorted chunks are merged level by level with
+         * merge_bounded_parallel, the threads and the buffer being shared
+         * out among the pairs of the level.
+         *
+         * @param array the pointer to the first element of the input array
+         * @param size the size of the input array
+         * @param threads the number of threads to use
+         *
+         */
+        template <class T>
+        void parallel_sort_bounded(T* array, uint32_t size, uint32_t threads)
+        {
+            uint32_t cap = (uint32_t)(std::min)(scratch_budget / sizeof(T), (uint64_t)size);
+            T* buf = (T*)_mm_malloc(sizeof(T) * (std::max)(cap, (uint32_t)1), 64);
+            uint32_t* bounds = new uint32_t[threads + 1];
+            std::thread** workers = new std::thread*[threads];
+
+            args_chunk<T>* chunk_args = new args_chunk<T>[threads];
+            uint32_t b = size / threads;
+            uint32_t m = size % threads;
+            for (uint32_t i = 0; i <= threads; i++)
+                bounds[i] = i * b + (std::min)(i, m);
+            for (uint32_t i = 0; i < threads; i++)
+            {
+                chunk_args[i].array = array + bounds[i];
+                chunk_args[i].size = bounds[i + 1] - bounds[i];
+                chunk_args[i].buf = buf + (uint64_t)cap * i / threads;
+                chunk_args[i].cap = (uint32_t)((uint64_t)cap * (i + 1) / threads - (uint64_t)cap * i / threads);
+                workers[i] = new std::thread(thread_chunk_kernel<T>, &chunk_args[i]);
+            }
+            for (uint32_t i = 0; i < threads; i++)
+                workers[i]->join();
+            for (uint32_t i = 0; i < threads; i++)
+                delete workers[i];
+            delete[] chunk_args;
+
+            args_bounded<T>* merge_args = new args_bounded<T>[threads];
+            for (uint32_t runs = threads; runs > 1; runs = (runs + 1) / 2)
+            {
+                uint32_t pairs = runs / 2;
+                for (uint32_t p = 0; p < pairs; p++)
+                {
+                    merge_args[p].array = array + bounds[2 * p];
+                    merge_args[p].n1 = bounds[2 * p + 1] - bounds[2 * p];
+                    merge_args[p].n2 = bounds[2 * p + 2] - bounds[2 * p + 1];
+                    merge_args[p].buf = buf + (uint64_t)cap * p / pairs;
+                    merge_args[p].cap = (uint32_t)((uint64_t)cap * (p + 1) / pairs - (uint64_t)cap * p / pairs);
+                    merge_args[p].threads = (uint32_t)((uint64_t)threads * (p + 1) / pairs - (uint64_t)threads * p / pairs);
+                    workers[p] = new std::thread(thread_bounded_kernel<T>, &merge_args[p]);
+                }
+                for (uint32_t p = 0; p < pairs; p++)
+                    workers[p]->join();
+                for (uint32_t p = 0; p < pairs; p++)
+                    delete workers[p];
+
+                for (uint32_t r = 0; r < runs; r += 2)
+                    bounds[r / 2] = bounds[r];
+                bounds[(runs + 1) / 2] = size;
+            }
+
+            delete[] merge_args;
+            delete[] workers;
+            delete[] bounds;
+            _mm_free(buf);
+        }
+
+    }
+
+}
@@ -0,0 +1,310 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file columns.h
+ * Definition of the lexicographic sort over several key columns. Every key
+ * is normalized to an unsigned integer of the same order and offset by the
+ * minimum of its column, so a column spans only the bits of its range. If
+ * the ranges fit in one word the columns are packed into a single key, and
+ * otherwise the rows are sorted a word of columns at a time, refining the
+ * groups of rows tied on the columns before.
+ *
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+
+#include "aspas.h"
+
+namespace aspas
+{
+
+    namespace internal
+    {
+
+        /// tie groups below this size are refined by comparison sort instead of the radix engine
+        const uint32_t columns_radix_min = 1 << 12;
+
+        /**
+         * A key column: its keys normalized by record_key32/64() lie in
+         * [min, min + range] and take bits bits once the minimum is
+         * subtracted.
+         */
+        struct column_field
+        {
+            const char* data;
+            key_type type;
+            uint32_t width;
+            bool descending;
+            uint64_t min;
+            uint64_t range;
+            uint32_t bits;
+        };
+
+        /**
+         * This method returns the number of bits of x.
+         *
+         */
+        inline uint32_t bit_length(uint64_t x)
+        {
+            uint32_t bits = 0;
+            while (x != 0)
+            {
+                bits++;
+                x >>= 1;
+            }
+            return bits;
+        }
+
+        /**
+         * This method returns the key of row i of the column normalized by
+         * record_key32/64().
+         *
+         */
+        inline uint64_t column_key(const column_field& f, uint32_t i)
+        {
+            return f.width == 4 ? record_key32(f.data + 4 * (uint64_t)i, f.type)
+                : record_key64(f.data + 8 * (uint64_t)i, f.type);
+        }
+
+        /**
+         * This method returns the field of row i of the column: its key
+         * offset to the minimum, reversed if the column is descending.
+         *
+         */
+        inline uint64_t column_value(const column_field& f, uint32_t i)
+        {
+            uint64_t v = column_key(f, i) - f.min;
+            return f.descending ? f.range - v : v;
+        }
+
+        /**
+         * This method fills the range and width of the column with one
+         * pass over its keys.
+         *
+         */
+        inline void scan_column(column_field& f, uint32_t size)
+        {
+            uint64_t lo = ~0ull, hi = 0;
+            for (uint32_t i = 0; i < size; i++)
+            {
+                uint64_t u = column_key(f, i);
+                lo = (std::min)(lo, u);
+                hi = (std::max)(hi, u);
+            }
+            f.min = lo;
+            f.range = hi - lo;
+            f.bits = bit_length(f.range);
+        }
+
+        /**
+         * This method appends value as a bits-bit field to the key word.
+         *
+         */
+        inline uint64_t append_field(uint64_t word, uint32_t bits, uint64_t value)
+        {
+            return bits >= 64 ? value : (word << bits) | value;
+        }
+
+        /**
+         * This method packs the fields of columns [c0, c1) of row i into one
+         * word, the first column in the most significant bits.
+         *
+         */
+        inline uint64_t pack_columns(const column_field* fields, uint32_t c0, uint32_t c1, uint32_t i)
+        {
+            uint64_t word = 0;
+            for (uint32_t c = c0; c < c1; c++)
+                if (fields[c].bits != 0)
+                    word = append_field(word, fields[c].bits, column_value(fields[c], i));
+            return word;
+        }
+
+        /**
+         * This method returns the end of the longest run of columns from c0
+         * whose fields fit in one word; it takes at least one column.
+         *
+         */
+        inline uint32_t column_group(const column_field* fields, uint32_t c0, uint32_t k)
+        {
+            uint32_t bits = fields[c0].bits;
+            uint32_t c1 = c0 + 1;
+            while (c1 < k && bits + fields[c1].bits <= 64)
+                bits += fields[c1++].bits;
+            return c1;
+        }
+
+        /**
+         * This method sorts pairs[0..n) by key, ties by index.
+         *
+         */
+        inline void sort_pairs(record_pair* pairs, uint32_t n)
+        {
+            if (n >= columns_radix_min)
+                radix_sort(pairs, n);
+            else
+                std::sort(pairs, pairs + n, [](const record_pair& a, const record_pair& b)
+                    { return a.key < b.key || (a.key == b.key && a.index < b.index); });
+        }
+
+        /**
+         * This method sorts perm[begin..end), rows tied on the columns before
+         * c0, by columns [c0, k): by the word of columns from c0, then each
+         * group tied on that word by the columns after it. pairs[begin..end)
+         * is the scratch of this range; a tie group only reuses the part of
+         * it that has already been scanned.
+         *
+         */
+        inline void refine_columns(const column_field* fields, uint32_t k, uint32_t c0, uint32_t* perm,
+            uint32_t begin, uint32_t end, record_pair* pairs)
+        {
+            uint32_t c1 = column_group(fields, c0, k);
+            for (uint32_t j = begin; j < end; j++)
+            {
+                pairs[j].key = pack_columns(fields, c0, c1, perm[j]);
+                pairs[j].index = perm[j];
+            }
+            sort_pairs(pairs + begin, end - begin);
+            for (uint32_t j = begin; j < end; j++)
+                perm[j] = (uint32_t)pairs[j].index;
+            if (c1 == k)
+                return;
+
+            uint32_t run = begin;
+            for (uint32_t j = begin + 1; j <= end; j++)
+            {
+                if (j == end || pairs[j].key != pairs[run].key)
+                {
+                    if (j - run > 1)
+                        refine_columns(fields, k, c1, perm, run, j, pairs);
+                    run = j;
+                }
+            }
+        }
+
+        /**
+         * This method sorts the rows on a 128-bit packed key: a radix pass on
+         * the low word, then a stable one on the high word.
+         *
+         */
+        inline void sort_columns128(const column_field* fields, uint32_t k, uint32_t size, uint32_t* perm)
+        {
+            uint64_t* high = (uint64_t*)_mm_malloc(sizeof(uint64_t) * size, 64);
+            record_pair* pairs = (record_pair*)_mm_malloc(sizeof(record_pair) * size, 64);
+            for (uint32_t i = 0; i < size; i++)
+            {
+                uint64_t hi = 0, lo = 0;
+                for (uint32_t c = 0; c < k; c++)
+                {
+                    uint32_t bits = fields[c].bits;
+                    if (bits == 0)
+                        continue;
+                    uint64_t v = column_value(fields[c], i);
+                    // shift the 128-bit (hi, lo) left by bits and or in v
+                    hi = bits >= 64 ? lo : (hi << bits) | (lo >> (64 - bits));
+                    lo = append_field(lo, bits, v);
+                }
+                high[i] = hi;
+                pairs[i].key = lo;
+                pairs[i].index = i;
+            }
+            radix_sort(pairs, size);
+            for (uint32_t i = 0; i < size; i++)
+                pairs[i].key = high[pairs[i].index];
+            radix_sort(pairs, size);
+            for (uint32_t i = 0; i < size; i++)
+                perm[i] = (uint32_t)pairs[i].index;
+
+            _mm_free(pairs);
+            _mm_free(high);
+        }
+
+    }
+
+    /**
+     * This method sorts the rows of k key columns lexicographically, as ORDER BY does, and
+     * returns the sorted order as a permutation: row perm[0] comes first. Rows with equal keys
+     * keep their order. The keys of a column can be of any key_type; floating point keys
+     * compare in IEEE total order. Apply perm to the columns with apply_permutation().
+     *
+     * If the ranges of the keys fit in 62 bits with the row number, the columns are packed
+     * into one key and sorted by the double kernels; if they fit in 64 or 128 bits, by the
+     * radix engine on a packed key; otherwise a word of columns at a time, refining the
+     * groups of rows tied so far.
+     *
+     * @param columns the pointers to the first key of every column
+     * @param types the key type of every column
+     * @param k the number of columns
+     * @param size the number of rows
+     * @param perm the saving target of the permutation, size entries
+     * @param orders the order of every column, ASCENDING or DESCENDING; all ascending if null
+     *
+     */
+     //! This method sorts the rows of several key columns and returns the permutation.
+    inline void sort_columns(const void* const* columns, const key_type* types, uint32_t k, uint32_t size,
+        uint32_t* perm, const key_order* orders = nullptr)
+    {
+        if (size == 0)
+            return;
+        for (uint32_t i = 0; i < size; i++)
+            perm[i] = i;
+        if (size == 1 || k == 0)
+            return;
+
+        internal::column_field* fields = new internal::column_field[k];
+        uint32_t total = 0;
+        for (uint32_t c = 0; c < k; c++)
+        {
+            fields[c].data = (const char*)columns[c];
+            fields[c].type = types[c];
+            fields[c].width = (types[c] == key_type::INT32 || types[c] == key_type::UINT32 || types[c] == key_type::FLOAT) ? 4 : 8;
+            fields[c].descending = orders != nullptr && orders[c] == key_order::DESCENDING;
+            internal::scan_column(fields[c], size);
+            total += fields[c].bits;
+        }
+
+        uint32_t index_bits = internal::bit_length(size - 1);
+        if (total + index_bits <= 62)
+        {
+            // unique non-negative keys below 2^62 order as doubles
+            uint64_t* combined = (uint64_t*)_mm_malloc(sizeof(uint64_t) * size, 64);
+            for (uint32_t i = 0; i < size; i++)
+                combined[i] = (internal::pack_columns(fields, 0, k, i) << index_bits) | i;
+            sort((double*)combined, size);
+            const uint64_t mask = (1ull << index_bits) - 1;
+            for (uint32_t i = 0; i < size; i++)
+                perm[i] = (uint32_t)(combined[i] & mask);
+            _mm_free(combined);
+        }
+        else if (total > 64 && total <= 128)
+        {
+            internal::sort_columns128(fields, k, size, perm);
+        }
+        else
+        {
+            // one word of columns covers total <= 64 in a single pass
+            internal::record_pair* pairs = (internal::record_pair*)_mm_malloc(sizeof(internal::record_pair) * size, 64);
+            internal::refine_columns(fields, k, 0, perm, 0, size, pairs);
+            _mm_free(pairs);
+        }
+
+        delete[] fields;
+    }
+
+}
@@ -0,0 +1,165 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file indirect.h
+ * Definition of sorting pointers by a key of the objects they point to.
+ * Every object is dereferenced once, in a pass that prefetches the objects
+ * ahead of it, and the keys are sorted with the pointers (or their index)
+ * attached, so the sort itself never touches the objects.
+ *
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "aspas.h"
+
+namespace aspas
+{
+
+    namespace internal
+    {
+
+        /// pointers between an object's prefetch and its key being read
+        const uint32_t indirect_prefetch = 16;
+
+        /**
+         * These methods map a key to an unsigned integer whose order is the
+         * order of the keys; floating point keys in IEEE total order.
+         *
+         */
+        inline uint64_t indirect_key(int x) { return stable_key(x); }
+        inline uint64_t indirect_key(uint32_t x) { return x; }
+        inline uint64_t indirect_key(float x) { return stable_key(x); }
+        inline uint64_t indirect_key(int64_t x) { return radix_key(x); }
+        inline uint64_t indirect_key(uint64_t x) { return x; }
+        inline uint64_t indirect_key(double x)
+        {
+            uint64_t b;
+            memcpy(&b, &x, sizeof(b));
+            return b ^ ((uint64_t)((int64_t)b >> 63) | 0x8000000000000000ull);
+        }
+
+        /**
+         * The key type a KeyFn result is sorted as: int, uint32_t, float,
+         * int64_t, uint64_t or double.
+         */
+        template <class K>
+        struct indirect_type
+        {
+            typedef typename std::conditional<std::is_floating_point<K>::value,
+                typename std::conditional<sizeof(K) == 4, float, double>::type,
+                typename std::conditional<sizeof(K) <= 4,
+                    typename std::conditional<std::is_signed<K>::value, int, uint32_t>::type,
+                    typename std::conditional<std::is_signed<K>::value, int64_t, uint64_t>::type>::type>::type type;
+        };
+
+        /**
+         * This method sorts ptrs by a 32-bit key. The keys are folded with
+         * their index into combined keys (stable.h) for the double kernels,
+         * or for the radix engine past stable_max pointers, and the pointers
+         * are then gathered by index.
+         *
+         */
+        template <class T, class K, class KeyFn>
+        void sort_indirect_folded(T** ptrs, uint32_t size, KeyFn key)
+        {
+            uint64_t* combined = (uint64_t*)_mm_malloc(sizeof(uint64_t) * size, 64);
+            uint32_t shift = size > stable_max ? 32 : stable_index_bits;
+            for (uint32_t i = 0; i < size; i++)
+            {
+                if (i + indirect_prefetch < size)
+                    _mm_prefetch((const char*)ptrs[i + indirect_prefetch], _MM_HINT_T0);
+                combined[i] = (indirect_key((K)key(ptrs[i])) << shift) | i;
+            }
+            if (size > stable_max)
+                radix_sort(combined, size);
+            else
+                sort((double*)combined, size);
+
+            // the indices replace the combined keys in place, then gather the pointers
+            const uint64_t mask = (1ull << shift) - 1;
+            uint32_t* perm = (uint32_t*)combined;
+            for (uint32_t i = 0; i < size; i++)
+                perm[i] = (uint32_t)(combined[i] & mask);
+            T** sorted = (T**)_mm_malloc(sizeof(T*) * size, 64);
+            aspas::apply_permutation(ptrs, perm, size, sorted);
+            std::copy(sorted, sorted + size, ptrs);
+
+            _mm_free(sorted);
+            _mm_free(combined);
+        }
+
+        /**
+         * This method sorts ptrs by key as (key, pointer) pairs on the radix
+         * engine, so the pointers come out of the sort in order. Digits that
+         * are zero for all keys are skipped, so 32-bit keys take four passes.
+         *
+         */
+        template <class T, class K, class KeyFn>
+        void sort_indirect_pairs(T** ptrs, uint32_t size, KeyFn key)
+        {
+            record_pair* pairs = (record_pair*)_mm_malloc(sizeof(record_pair) * size, 64);
+            for (uint32_t i = 0; i < size; i++)
+            {
+                if (i + indirect_prefetch < size)
+                    _mm_prefetch((const char*)ptrs[i + indirect_prefetch], _MM_HINT_T0);
+                pairs[i].key = indirect_key((K)key(ptrs[i]));
+                pairs[i].index = (uint64_t)(uintptr_t)ptrs[i];
+            }
+            radix_sort(pairs, size);
+            for (uint32_t i = 0; i < size; i++)
+                ptrs[i] = (T*)(uintptr_t)pairs[i].index;
+            _mm_free(pairs);
+        }
+
+    }
+
+    /**
+     * This method sorts the given pointers by the key of the objects they point to. key is
+     * called once per object, in a pass that prefetches the objects ahead; the sort itself
+     * runs on the keys only. Pointers with equal keys keep their order.
+     *
+     * @param ptrs the pointers to sort
+     * @param size the number of pointers, below 2^32
+     * @param key a function from const T* to a numeric key: any integer or floating point
+     * type up to 8 bytes; floating point keys compare in IEEE total order
+     * @return the sorted pointers are stored in ptrs
+     *
+     */
+     //! This method sorts the given pointers by the keys of their objects.
+    template <class T, class KeyFn>
+    void sort_indirect(T** ptrs, size_t size, KeyFn key)
+    {
+        typedef typename std::decay<decltype(key((const T*)ptrs[0]))>::type R;
+        typedef typename internal::indirect_type<R>::type K;
+        if (size < 2)
+            return;
+        // 32-bit keys take the radix engine where sort() would, as in try_radix_sort()
+        bool pairs = sizeof(K) == 8 || sort_engine_mode == sort_engine::RADIX ||
+            (sort_engine_mode == sort_engine::AUTO && size >= internal::radix_min_size);
+        if (pairs)
+            internal::sort_indirect_pairs<T, K>(ptrs, (uint32_t)size, key);
+        else
+            internal::sort_indirect_folded<T, K>(ptrs, (uint32_t)size, key);
+    }
+
+}
@@ -0,0 +1,423 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file inplace.h
+ * Definition of the in-place sorting mode: a quicksort whose partitioning
+ * step is vectorized with AVX2 (compress through a permutation lookup
+ * table), finishing small partitions with the sorter and the bitonic merge
+ * kernel. Extra memory is the recursion stack plus one small scratch block
+ * per thread, instead of the size-element buffer of merger.
+ *
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+
+#include "aspas.h"
+#include "tools.h"
+
+namespace aspas
+{
+
+    namespace internal
+    {
+
+        /// partitions of at most this many elements are finished by sorter and merge
+        const uint32_t inplace_small = 1024;
+
+        /// partitions below this size are not split further across threads
+        uint64_t inplace_parallel_min = 1 << 16;
+
+        /**
+         * Permutations that move the lanes of a 256-bit vector whose mask bit
+         * is clear to the low end and the others to the high end, both in
+         * their original order. Entries are 32-bit slot indices, so a lane of
+         * a double is two slots.
+         */
+        struct partition_table
+        {
+            uint8_t index[256][8];
+
+            partition_table(uint32_t lanes)
+            {
+                uint32_t width = 8 / lanes;
+                for (uint32_t mask = 0; mask < (1u << lanes); mask++)
+                {
+                    uint32_t k = 0;
+                    for (uint32_t side = 0; side < 2; side++)
+                        for (uint32_t lane = 0; lane < lanes; lane++)
+                            if (((mask >> lane) & 1) == side)
+                                for (uint32_t w = 0; w < width; w++)
+                                    index[mask][k++] = (uint8_t)(lane * width + w);
+                }
+            }
+        };
+
+        template <class T>
+        const uint8_t* partition_lut(uint32_t mask)
+        {
+            static const partition_table table(32 / sizeof(T));
+            return table.index[mask];
+        }
+
+        /**
+         * Integer version: <br>
+         * This method returns the mask of the lanes of p[0..7] that belong
+         * right of the pivot: keys above it (strict) or not below it.
+         *
+         */
+        inline uint32_t partition_mask(const int* p, int pivot, bool strict)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i*)p);
+            __m256i pv = _mm256_set1_epi32(pivot);
+            __m256i m = strict ? _mm256_cmpgt_epi32(v, pv) : _mm256_cmpgt_epi32(pv, v);
+            uint32_t bits = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(m));
+            return strict ? bits : ~bits & 0xFF;
+        }
+
+        /**
+         * Float version: <br>
+         * This method returns the mask of the lanes of p[0..7] that belong
+         * right of the pivot.
+         *
+         */
+        inline uint32_t partition_mask(const float* p, float pivot, bool strict)
+        {
+            __m256 v = _mm256_loadu_ps(p);
+            __m256 pv = _mm256_set1_ps(pivot);
+            __m256 m = strict ? _mm256_cmp_ps(v, pv, _CMP_GT_OQ) : _mm256_cmp_ps(v, pv, _CMP_GE_OQ);
+            return (uint32_t)_mm256_movemask_ps(m);
+        }
+
+        /**
+         * Double version: <br>
+         * This method returns the mask of the lanes of p[0..3] that belong
+         * right of the pivot.
+         *
+         */
+        inline uint32_t partition_mask(const double* p, double pivot, bool strict)
+        {
+            __m256d v = _mm256_loadu_pd(p);
+            __m256d pv = _mm256_set1_pd(pivot);
+            __m256d m = strict ? _mm256_cmp_pd(v, pv, _CMP_GT_OQ) : _mm256_cmp_pd(v, pv, _CMP_GE_OQ);
+            return (uint32_t)_mm256_movemask_pd(m);
+        }
+
+        /**
+         * This method partitions the vector at src and writes its left lanes
+         * at a + l_write and its right lanes just below a + r_write. Both
+         * stores are a full vector wide, so there must be a vector of free
+         * space at either end.
+         *
+         */
+        template <class T>
+        __forceinline void partition_vector(const T* src, T pivot, bool strict, T* a, uint64_t& l_write, uint64_t& r_write)
+        {
+            const uint32_t lanes = 32 / sizeof(T);
+            uint32_t mask = partition_mask(src, pivot, strict);
+            __m256i perm = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)partition_lut<T>(mask)));
+            __m256i v = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)src), perm);
+            uint32_t right = util::popcnt(mask);
+
+            _mm256_storeu_si256((__m256i*)(a + l_write), v);
+            _mm256_storeu_si256((__m256i*)(a + r_write - lanes), v);
+            l_write += lanes - right;
+            r_write -= right;
+        }
+
+        /**
+         * This method partitions a[0..n) in place around pivot: keys below it
+         * (or, with strict set, not above it) end up left of the returned
+         * position, all others right of it. The first and last vector are
+         * held aside so that every store has room; each step then reads a
+         * vector from the end with less room left.
+         *
+         * @param a the partition
+         * @param n its size, at least two vectors
+         * @param pivot the pivot
+         * @param strict send keys equal to the pivot to the left
+         * @return the number of keys on the left
+         *
+         */
+        template <class T>
+        uint64_t partition_inplace(T* a, uint64_t n, T pivot, bool strict)
+        {
+            const uint32_t lanes = 32 / sizeof(T);
+            T rest[3 * 8];
+
+            std::copy(a, a + lanes, rest);
+            std::copy(a + n - lanes, a + n, rest + lanes);
+            uint64_t l_read = lanes, r_read = n - lanes;
+            uint64_t l_write = 0, r_write = n;
+
+            while (r_read - l_read >= lanes)
+            {
+                if (l_read - l_write <= r_write - r_read)
+                {
+                    partition_vector(a + l_read, pivot, strict, a, l_write, r_write);
+                    l_read += lanes;
+                }
+                else
+                {
+                    r_read -= lanes;
+                    partition_vector(a + r_read, pivot, strict, a, l_write, r_write);
+                }
+            }
+
+            // the unread tail and the two held vectors fill the gap exactly
+            uint32_t held = 2 * lanes;
+            std::copy(a + l_read, a + r_read, rest + held);
+            held += (uint32_t)(r_read - l_read);
+            for (uint32_t i = 0; i < held; i++)
+            {
+                if (strict ? rest[i] > pivot : rest[i] >= pivot)
+                    a[--r_write] = rest[i];
+                else
+                    a[l_write++] = rest[i];
+            }
+            return l_write;
+        }
+
+        /**
+         * This method returns the median of nine keys spread over a[0..n).
+         *
+         */
+        template <class T>
+        T choose_pivot(const T* a, uint64_t n)
+        {
+            T s[9];
+            for (uint32_t i = 0; i < 9; i++)
+                s[i] = a[(n - 1) * i / 8];
+            std::nth_element(s, s + 4, s + 9);
+            return s[4];
+        }
+
+        /**
+         * This method sorts a small partition with sorter and bitonic merge
+         * passes, ping-ponging through scratch (inplace_small elements).
+         *
+         */
+        template <class T>
+        void sort_small(T* a, uint32_t n, T* scratch)
+        {
+            uint8_t stride;
+            uint32_t way;
+            merger_params<T>(stride, way);
+
+            sorter(a, n);
+            T* src = a;
+            T* dst = scratch;
+            for (uint32_t i = stride; i < n; i *= 2)
+            {
+                for (uint32_t j = 0; j < n; j += 2 * i)
+                {
+                    uint32_t mid = (std::min)(j + i, n);
+                    uint32_t end = (std::min)(j + 2 * i, n);
+                    merge(src + j, mid - j, src + mid, end - mid, dst + j);
+                }
+                std::swap(src, dst);
+            }
+            if (src != a)
+                std::copy(src, src + n, a);
+        }
+
+        /**
+         * This method splits a[0..n) around a pivot. Keys equal to the
+         * smallest key are split off first if the pivot happens to be the
+         * minimum, since they are already in place.
+         *
+         * @param a the partition, updated to the part still to be split
+         * @param n its size, updated likewise
+         * @return the size of the left part, 0 if only the minimum was removed
+         *
+         */
+        template <class T>
+        uint64_t split_inplace(T*& a, uint64_t& n)
+        {
+            T pivot = choose_pivot(a, n);
+            uint64_t mid = partition_inplace(a, n, pivot, false);
+            if (mid != 0)
+                return mid;
+
+            // nothing is below the pivot: the keys equal to it are done
+            mid = partition_inplace(a, n, pivot, true);
+            a += mid;
+            n -= mid;
+            return 0;
+        }
+
+        /**
+         * This method sorts a[0..n) in place. It recurses into the smaller
+         * side and loops on the larger one, so the stack is O(log n); after
+         * depth bad splits it falls back to heap sort.
+         *
+         */
+        template <class T>
+        void quicksort_inplace(T* a, uint64_t n, uint32_t depth, T* scratch)
+        {
+            while (n > inplace_small)
+            {
+                if (depth == 0)
+                {
+                    std::make_heap(a, a + n);
+                    std::sort_heap(a, a + n);
+                    return;
+                }
+                depth--;
+
+                uint64_t mid = split_inplace(a, n);
+                if (mid == 0)
+                    continue;
+                if (mid < n - mid)
+                {
+                    quicksort_inplace(a, mid, depth, scratch);
+                    a += mid;
+                    n -= mid;
+                }
+                else
+                {
+                    quicksort_inplace(a + mid, n - mid, depth, scratch);
+                    n = mid;
+                }
+            }
+            sort_small(a, (uint32_t)n, scratch);
+        }
+
+        /**
+         * This method returns the depth limit of quicksort_inplace for n keys.
+         *
+         */
+        inline uint32_t inplace_depth(uint64_t n)
+        {
+            uint32_t depth = 0;
+            while (n > 1)
+            {
+                depth += 2;
+                n >>= 1;
+            }
+            return depth;
+        }
+
+        template<class T>
+        void quicksort_parallel(T* a, uint64_t n, uint32_t depth, uint32_t threads);
+
+        template<class T>
+        struct args_qsort
+        {
+            T* array;
+            uint64_t size;
+            uint32_t depth;
+            uint32_t threads;
+        };
+
+        template<class T>
+        void thread_qsort_kernel(void* arguments)
+        {
+            args_qsort<T>* args = (args_qsort<T>*)arguments;
+            quicksort_parallel(args->array, args->size, args->depth, args->threads);
+        }
+
+        /**
+         * This method sorts a[0..n) in place with up to threads threads. After
+         * each split the threads are shared out in proportion to the sides,
+         * one side going to a new thread, until a side has one thread or is
+         * smaller than inplace_parallel_min.
+         *
+         */
+        template<class T>
+        void quicksort_parallel(T* a, uint64_t n, uint32_t depth, uint32_t threads)
+        {
+            while (threads > 1 && n > inplace_parallel_min && depth > 0)
+            {
+                depth--;
+                uint64_t mid = split_inplace(a, n);
+                if (mid == 0)
+                    continue;
+
+                uint32_t t_left = (uint32_t)(((uint64_t)threads * mid + n / 2) / n);
+                t_left = (std::max)((std::min)(t_left, threads - 1), (uint32_t)1);
+
+                args_qsort<T> left_args;
+                left_args.array = a;
+                left_args.size = mid;
+                left_args.depth = depth;
+                left_args.threads = t_left;
+                std::thread worker(thread_qsort_kernel<T>, &left_args);
+
+                quicksort_parallel(a + mid, n - mid, depth, threads - t_left);
+                worker.join();
+                return;
+            }
+
+            T* scratch = (T*)_mm_malloc(sizeof(T) * inplace_small, 64);
+            quicksort_inplace(a, n, depth, scratch);
+            _mm_free(scratch);
+        }
+
+
+        /**
+         * This method sorts a[0..n) in place with the given number of threads.
+         *
+         */
+        template<class T>
+        void parallel_inplace(T* a, uint64_t n, uint32_t threads)
+        {
+            quicksort_parallel(a, n, inplace_depth(n), threads);
+        }
+
+    }
+
+    /**
+     * This method sorts the given input array in place. Currently the input array can be of
+     * the type of int, float, and double. No buffer of the input size is needed: the extra
+     * memory is O(log n) plus a small fixed scratch block.
+     *
+     * @param array the pointer to the first element of the input array
+     * @param size the size of the input array
+     * @return the sorted elements are stored in the pointer of array
+     *
+     */
+     //! This method sorts the given input array in place.
+    template <class T>
+    void sort_inplace(T* array, size_t size)
+    {
+        T* scratch = (T*)_mm_malloc(sizeof(T) * internal::inplace_small, 64);
+        internal::quicksort_inplace(array, (uint64_t)size, internal::inplace_depth(size), scratch);
+        _mm_free(scratch);
+    }
+
+    /**
+     * This method sorts the given input array in place with several threads, which take
+     * over partitions as the quicksort splits them.
+     *
+     * @param array the pointer to the first element of the input array
+     * @param size the size of the input array
+     * @param threads the number of threads to use
+     * @return the sorted elements are stored in the pointer of array
+     *
+     */
+     //! This method sorts the given input array in place with multiple threads.
+    template <class T>
+    void parallel_sort_inplace(T* array, size_t size, uint32_t threads = thread_num)
+    {
+        internal::parallel_inplace(array, (uint64_t)size, threads);
+    }
+
+}
@@ -0,0 +1,324 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file join.h
+ * Definition of the sort-merge join of two key-sorted key-value arrays. The
+ * keys are joined key by key, every run of equal keys on one side with the
+ * run on the other; once a vector's worth of keys passes without a match,
+ * they are walked a vector of each side at a time as by the set operations
+ * (sets.h), skipping vectors below the other side and pairs of vectors
+ * without a common key. The parallel join cuts both inputs by co-rank at
+ * key boundaries.
+ *
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+
+#include "aspas.h"
+
+namespace aspas
+{
+
+    namespace internal
+    {
+
+        /// parts below this size per thread are not joined in parallel
+        const uint32_t join_parallel_min = 1 << 14;
+
+        /**
+         * This method joins keysA[0..sizeA) with keysB[0..sizeB) and stores
+         * the value pairs of equal keys to outA and outB: by key, then in
+         * the order of A, then in the order of B. With outA null the pairs
+         * are only counted. Sparse matches take the vector walk, dense ones
+         * never leave the key by key loop.
+         *
+         * @return the number of pairs
+         *
+         */
+        template <class K, class V, class W>
+        uint64_t join_range(const K* keysA, const V* valuesA, uint32_t sizeA, const K* keysB, const W* valuesB, uint32_t sizeB,
+            V* outA, W* outB)
+        {
+            const uint32_t lanes = 32 / sizeof(K);
+            uint32_t i = 0, j = 0;
+            uint64_t w = 0;
+            // keys since the last match; dense matches are joined key by key throughout
+            uint32_t misses = 0;
+            while (i < sizeA && j < sizeB)
+            {
+                if (misses >= lanes && i + lanes <= sizeA && j + lanes <= sizeB)
+                {
+                    K a = keysA[i + lanes - 1], b = keysB[j + lanes - 1];
+                    if (a < keysB[j])
+                    {
+                        i += lanes;
+                        continue;
+                    }
+                    if (b < keysA[i])
+                    {
+                        j += lanes;
+                        continue;
+                    }
+                    if (match_mask(keysA + i, keysB + j) == 0)
+                    {
+                        // a == b would have matched
+                        if (a < b)
+                            i += lanes;
+                        else
+                            j += lanes;
+                        continue;
+                    }
+                    misses = 0;
+                }
+
+                K a = keysA[i], b = keysB[j];
+                if (a != b)
+                {
+                    i += a < b;
+                    j += b < a;
+                    misses++;
+                    continue;
+                }
+                uint32_t run_a = i + 1, run_b = j + 1;
+                while (run_a < sizeA && keysA[run_a] == a)
+                    run_a++;
+                while (run_b < sizeB && keysB[run_b] == a)
+                    run_b++;
+                if (outA != nullptr)
+                {
+                    for (uint32_t p = i; p < run_a; p++)
+                        for (uint32_t q = j; q < run_b; q++)
+                        {
+                            outA[w] = valuesA[p];
+                            outB[w++] = valuesB[q];
+                        }
+                }
+                else
+                    w += (uint64_t)(run_a - i) * (run_b - j);
+                i = run_a;
+                j = run_b;
+                misses = 0;
+            }
+            return w;
+        }
+
+        /**
+         * This method returns the position in keys[0..size) of the first key
+         * right of a co-rank cut at pos that is not equal to the key before
+         * the cut on either side, so that no run of equal keys is split.
+         *
+         */
+        template <class K>
+        uint32_t join_boundary(const K* keys, uint32_t size, uint32_t pos, bool has_next, K next)
+        {
+            if (!has_next)
+                return size;
+            return (uint32_t)(std::lower_bound(keys, keys + pos, next) - keys);
+        }
+
+        template <class K, class V, class W>
+        struct args_join
+        {
+            uint32_t tid;
+            const K* keysA;
+            const V* valuesA;
+            const K* keysB;
+            const W* valuesB;
+            uint32_t* cutA;
+            uint32_t* cutB;
+            uint64_t* offset;
+            V* outA;
+            W* outB;
+        };
+
+        /**
+         * This method counts the pairs of the part of a thread, or with the
+         * offsets known stores them.
+         *
+         */
+        template <class K, class V, class W>
+        void thread_join_kernel(void* arguments)
+        {
+            args_join<K, V, W>* args = (args_join<K, V, W>*)arguments;
+            uint32_t t = args->tid;
+            uint32_t a0 = args->cutA[t], b0 = args->cutB[t];
+            V* outA = args->outA != nullptr ? args->outA + args->offset[t] : nullptr;
+            W* outB = args->outB != nullptr ? args->outB + args->offset[t] : nullptr;
+            uint64_t pairs = join_range(args->keysA + a0, args->valuesA + a0, args->cutA[t + 1] - a0,
+                args->keysB + b0, args->valuesB + b0, args->cutB[t + 1] - b0, outA, outB);
+            if (outA == nullptr)
+                args->offset[t] = pairs;
+        }
+
+        /**
+         * This method runs thread_join_kernel on every part.
+         *
+         */
+        template <class K, class V, class W>
+        void join_pass(args_join<K, V, W> proto, uint32_t threads)
+        {
+            std::thread* workers = new std::thread[threads];
+            args_join<K, V, W>* args = new args_join<K, V, W>[threads];
+            for (uint32_t t = 0; t < threads; t++)
+            {
+                args[t] = proto;
+                args[t].tid = t;
+                workers[t] = std::thread(thread_join_kernel<K, V, W>, &args[t]);
+            }
+            for (uint32_t t = 0; t < threads; t++)
+                workers[t].join();
+            delete[] workers;
+            delete[] args;
+        }
+
+        /**
+         * This method joins the inputs with the given number of threads: the
+         * merged keys are cut into equal parts by co-rank (find_kth2), every
+         * cut moved back to the first key of its run, and the parts are
+         * joined once to count their pairs and once more to store them at
+         * the prefix sums of the counts.
+         *
+         * @return the number of pairs
+         *
+         */
+        template <class K, class V, class W>
+        uint64_t merge_join(const K* keysA, const V* valuesA, uint32_t sizeA, const K* keysB, const W* valuesB, uint32_t sizeB,
+            V* outA, W* outB, uint32_t threads)
+        {
+            uint64_t total = (uint64_t)sizeA + sizeB;
+            threads = (uint32_t)(std::max)((std::min)((uint64_t)threads, total / join_parallel_min), (uint64_t)1);
+            if (threads == 1)
+                return join_range(keysA, valuesA, sizeA, keysB, valuesB, sizeB, outA, outB);
+
+            uint32_t* cutA = new uint32_t[threads + 1];
+            uint32_t* cutB = new uint32_t[threads + 1];
+            uint64_t* offset = new uint64_t[threads + 1];
+            cutA[0] = cutB[0] = 0;
+            cutA[threads] = sizeA;
+            cutB[threads] = sizeB;
+            for (uint32_t t = 1; t < threads; t++)
+            {
+                uint32_t ia, ib;
+                find_corank((K*)keysA, sizeA, (K*)keysB, sizeB, (uint32_t)(total * t / threads), ia, ib);
+                // the first key right of the cut; its run moves right on both sides
+                bool has_next = ia < sizeA || ib < sizeB;
+                K next = ia == sizeA ? keysB[ib] : ib == sizeB ? keysA[ia] : (std::min)(keysA[ia], keysB[ib]);
+                cutA[t] = join_boundary(keysA, sizeA, ia, has_next, next);
+                cutB[t] = join_boundary(keysB, sizeB, ib, has_next, next);
+            }
+
+            args_join<K, V, W> proto;
+            proto.keysA = keysA;
+            proto.valuesA = valuesA;
+            proto.keysB = keysB;
+            proto.valuesB = valuesB;
+            proto.cutA = cutA;
+            proto.cutB = cutB;
+            proto.offset = offset;
+            proto.outA = nullptr;
+            proto.outB = nullptr;
+            join_pass(proto, threads);
+
+            uint64_t pairs = 0;
+            for (uint32_t t = 0; t <= threads; t++)
+            {
+                uint64_t count = t < threads ? offset[t] : 0;
+                offset[t] = pairs;
+                pairs += count;
+            }
+            if (outA != nullptr)
+            {
+                proto.outA = outA;
+                proto.outB = outB;
+                join_pass(proto, threads);
+            }
+
+            delete[] offset;
+            delete[] cutB;
+            delete[] cutA;
+            return pairs;
+        }
+
+    }
+
+    /**
+     * This method returns the number of pairs merge_join() stores for the given keys.
+     *
+     * @param keysA the keys of the first input, sorted
+     * @param sizeA the size of the first input
+     * @param keysB the keys of the second input, sorted
+     * @param sizeB the size of the second input
+     * @return the number of pairs of equal keys
+     *
+     */
+     //! This method counts the pairs of a sort-merge join.
+    template <class K>
+    uint64_t merge_join_size(const K* keysA, uint32_t sizeA, const K* keysB, uint32_t sizeB)
+    {
+        return internal::join_range(keysA, (const char*)nullptr, sizeA, keysB, (const char*)nullptr, sizeB,
+            (char*)nullptr, (char*)nullptr);
+    }
+
+    /**
+     * This method joins two key-value arrays sorted by key: for every pair of equal keys, one
+     * from each input, it stores the value of A to outA and the value of B to outB. Runs of
+     * equal keys join many-to-many. The pairs come by key, then in the order of A, then in
+     * the order of B. Currently the keys can be of the type of int, uint32_t, and int64_t;
+     * the values can be of any copyable type.
+     *
+     * @param keysA valuesA the first key-value array, sorted by key
+     * @param sizeA the size of the first array
+     * @param keysB valuesB the second key-value array, sorted by key
+     * @param sizeB the size of the second array
+     * @param outA outB the saving target of the value pairs, room for merge_join_size() pairs
+     * @return the number of pairs stored
+     *
+     */
+     //! This method joins two sorted key-value arrays on their keys.
+    template <class K, class V, class W>
+    uint64_t merge_join(const K* keysA, const V* valuesA, uint32_t sizeA, const K* keysB, const W* valuesB, uint32_t sizeB,
+        V* outA, W* outB)
+    {
+        return internal::join_range(keysA, valuesA, sizeA, keysB, valuesB, sizeB, outA, outB);
+    }
+
+    /**
+     * This method joins two key-value arrays sorted by key like merge_join(), with the inputs
+     * split across thread_num threads by co-rank. The pairs are counted before they are
+     * stored, so the outputs may also be null to only count them.
+     *
+     * @param keysA valuesA the first key-value array, sorted by key
+     * @param sizeA the size of the first array
+     * @param keysB valuesB the second key-value array, sorted by key
+     * @param sizeB the size of the second array
+     * @param outA outB the saving target of the value pairs, room for merge_join_size() pairs
+     * @return the number of pairs
+     *
+     */
+     //! This method joins two sorted key-value arrays on their keys with multiple threads.
+    template <class K, class V, class W>
+    uint64_t parallel_merge_join(const K* keysA, const V* valuesA, uint32_t sizeA, const K* keysB, const W* valuesB, uint32_t sizeB,
+        V* outA, W* outB)
+    {
+        return internal::merge_join(keysA, valuesA, sizeA, keysB, valuesB, sizeB, outA, outB, thread_num);
+    }
+
+}
@@ -0,0 +1,229 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file keys.h
+ * Definition of the key orders and of the key transforms behind them. A
+ * transform is a bijection on the bit patterns of the keys that maps the
+ * requested order onto the ascending order of the kernels: sorter() encodes
+ * the keys right after loading them and the last merge pass decodes them
+ * before storing, so the order costs no pass of its own.
+ *
+ */
+
+#include <immintrin.h>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace aspas
+{
+
+    /// order of the keys produced by sort(array, size, order)
+    enum class key_order : std::int8_t
+    {
+        ASCENDING,
+        DESCENDING,
+        ABS,        ///< ascending absolute value, of x and -x the negative first
+        TOTAL       ///< IEEE 754 total order for floating point keys, NaNs at the ends
+    };
+
+    namespace internal
+    {
+
+        /// operation of a key transform
+        enum class key_op : std::int8_t
+        {
+            NONE,
+            XOR,        ///< xor with mask: reverses or biases the order
+            ZIGZAG,     ///< int by absolute value
+            ROTATE,     ///< float bits by absolute value
+            FLIP        ///< float bits in total order
+        };
+
+        /**
+         * A key transform. ZIGZAG, ROTATE and FLIP work on 32-bit integer
+         * lanes; XOR on any lane width, with mask replicated to 64 bits.
+         */
+        struct key_transform
+        {
+            key_op op;
+            uint64_t mask;
+
+            key_transform(key_op o = key_op::NONE, uint64_t m = 0) : op(o), mask(m) {}
+        };
+
+        /**
+         * This method encodes a vector of keys.
+         *
+         */
+        inline __m256i encode_vector(__m256i v, key_transform tf)
+        {
+            switch (tf.op)
+            {
+            case key_op::XOR:
+                return _mm256_xor_si256(v, _mm256_set1_epi64x((long long)tf.mask));
+            case key_op::ZIGZAG:
+                // (x << 1) ^ (x >> 31), biased to signed order
+                return _mm256_xor_si256(_mm256_xor_si256(_mm256_slli_epi32(v, 1), _mm256_srai_epi32(v, 31)),
+                    _mm256_set1_epi32((int)0x80000000));
+            case key_op::ROTATE:
+                // sign to the low bit, negatives first, biased to signed order
+                return _mm256_xor_si256(_mm256_or_si256(_mm256_slli_epi32(v, 1), _mm256_srli_epi32(v, 31)),
+                    _mm256_set1_epi32((int)0x80000001));
+            case key_op::FLIP:
+                return _mm256_xor_si256(v, _mm256_and_si256(_mm256_srai_epi32(v, 31), _mm256_set1_epi32(0x7fffffff)));
+            default:
+                return v;
+            }
+        }
+
+        /**
+         * This method decodes a vector of keys.
+         *
+         */
+        inline __m256i decode_vector(__m256i v, key_transform tf)
+        {
+            __m256i u;
+            switch (tf.op)
+            {
+            case key_op::ZIGZAG:
+                u = _mm256_xor_si256(v, _mm256_set1_epi32((int)0x80000000));
+                return _mm256_xor_si256(_mm256_srli_epi32(u, 1),
+                    _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_and_si256(u, _mm256_set1_epi32(1))));
+            case key_op::ROTATE:
+                u = _mm256_xor_si256(v, _mm256_set1_epi32((int)0x80000001));
+                return _mm256_or_si256(_mm256_srli_epi32(u, 1), _mm256_slli_epi32(u, 31));
+            default:
+                // XOR and FLIP are their own inverse
+                return encode_vector(v, tf);
+            }
+        }
+
+        inline __m256 encode_vector(__m256 v, key_transform tf)
+        {
+            return _mm256_castsi256_ps(encode_vector(_mm256_castps_si256(v), tf));
+        }
+
+        inline __m256d encode_vector(__m256d v, key_transform tf)
+        {
+            return _mm256_castsi256_pd(encode_vector(_mm256_castpd_si256(v), tf));
+        }
+
+        /**
+         * These methods encode and decode the bit pattern of one key.
+         *
+         */
+        inline uint32_t encode_bits(uint32_t b, key_transform tf)
+        {
+            switch (tf.op)
+            {
+            case key_op::XOR:
+                return b ^ (uint32_t)tf.mask;
+            case key_op::ZIGZAG:
+                return ((b << 1) ^ (uint32_t)((int32_t)b >> 31)) ^ 0x80000000u;
+            case key_op::ROTATE:
+                return ((b << 1) | (b >> 31)) ^ 0x80000001u;
+            case key_op::FLIP:
+                return b ^ ((uint32_t)((int32_t)b >> 31) & 0x7fffffffu);
+            default:
+                return b;
+            }
+        }
+
+        inline uint32_t decode_bits(uint32_t b, key_transform tf)
+        {
+            switch (tf.op)
+            {
+            case key_op::ZIGZAG:
+                b ^= 0x80000000u;
+                return (b >> 1) ^ (0u - (b & 1));
+            case key_op::ROTATE:
+                b ^= 0x80000001u;
+                return (b >> 1) | (b << 31);
+            default:
+                return encode_bits(b, tf);
+            }
+        }
+
+        inline uint64_t encode_bits(uint64_t b, key_transform tf)
+        {
+            return tf.op == key_op::XOR ? b ^ tf.mask : b;
+        }
+
+        inline uint64_t decode_bits(uint64_t b, key_transform tf)
+        {
+            return encode_bits(b, tf);
+        }
+
+        /**
+         * This method encodes (or decodes) a[0..n) in place.
+         *
+         */
+        template <class T>
+        void transform_keys(T* a, uint64_t n, key_transform tf, bool decode)
+        {
+            typedef typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type bits_t;
+            const uint32_t lanes = 32 / sizeof(T);
+            if (tf.op == key_op::NONE)
+                return;
+
+            uint64_t i;
+            for (i = 0; i + lanes <= n; i += lanes)
+            {
+                __m256i v = _mm256_loadu_si256((const __m256i*)(a + i));
+                v = decode ? decode_vector(v, tf) : encode_vector(v, tf);
+                _mm256_storeu_si256((__m256i*)(a + i), v);
+            }
+            for (/* cont'd */; i < n; i++)
+            {
+                bits_t b;
+                memcpy(&b, a + i, sizeof(T));
+                b = decode ? decode_bits(b, tf) : encode_bits(b, tf);
+                memcpy(a + i, &b, sizeof(T));
+            }
+        }
+
+        /**
+         * This method decodes src[0..n) into dst, with non-temporal stores
+         * if stream is set and dst is 32-byte aligned.
+         *
+         */
+        template <class T>
+        void decode_copy(T* dst, const T* src, uint32_t n, key_transform tf, bool stream)
+        {
+            const uint32_t lanes = 32 / sizeof(T);
+            stream = stream && ((uintptr_t)dst & 31) == 0;
+
+            uint32_t i;
+            for (i = 0; i + lanes <= n; i += lanes)
+            {
+                __m256i v = decode_vector(_mm256_loadu_si256((const __m256i*)(src + i)), tf);
+                if (stream)
+                    _mm256_stream_si256((__m256i*)(dst + i), v);
+                else
+                    _mm256_storeu_si256((__m256i*)(dst + i), v);
+            }
+            if (stream)
+                _mm_sfence();
+            std::memcpy(dst + i, src + i, sizeof(T) * (n - i));
+            transform_keys(dst + i, n - i, tf, true);
+        }
+
+    }
+
+}
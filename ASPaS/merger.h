@@ -37,12 +37,54 @@
 #endif 
 #endif
 
+#include "multiway.h"
+
 namespace aspas
 {
 
+    /**
+     * Upper limit in bytes on the scratch space of sort() and parallel_sort().
+     * 0 means no limit; otherwise inputs whose copy would not fit are merged
+     * in place through a buffer of at most this size.
+     */
+    uint64_t scratch_budget = 0;
+
     namespace internal
     {
 
+        template <typename T>
+        void merger_bounded(T* orig, uint32_t size, T* buf, uint32_t cap);
+
+        /**
+         * What the last merge pass does besides merging: decode the keys
+         * with tf and, if unique is set, drop repeated keys, storing the
+         * number of copies of every kept key in counts unless it is null.
+         * With sink set the merged keys are not stored at all but handed to
+         * sink(keys, n, state) a tile at a time, in order.
+         */
+        struct merge_tail
+        {
+            key_transform tf;
+            bool unique;
+            uint32_t* counts;
+            void (*sink)(const void* keys, uint32_t n, void* state);
+            void* state;
+
+            merge_tail(key_transform t = key_transform(), bool u = false, uint32_t* c = nullptr)
+                : tf(t), unique(u), counts(c), sink(nullptr), state(nullptr) {}
+            merge_tail(void (*s)(const void*, uint32_t, void*), void* st)
+                : tf(), unique(false), counts(nullptr), sink(s), state(st) {}
+        };
+
+        template <typename T>
+        uint32_t merge_decode(T* inputA, uint32_t sizeA, T* inputB, uint32_t sizeB, T* output, bool stream, merge_tail tail);
+
+        template <typename T>
+        uint32_t kway_merge_decode(T* const* runs, const uint32_t* lens, uint32_t k, T* output, bool stream, merge_tail tail);
+
+        template <typename T>
+        uint32_t unique_copy(const T* src, uint32_t n, T* dst, T& last, bool& any, uint32_t* counts, uint32_t written);
+
         /*
         template <typename T>
         void merger(T*& orig, uint32_t size)
@@ -109,12 +151,68 @@ namespace aspas
         }
         // */
 
+        /**
+         * Tuned number of stride-sized segments merged per in-cache block,
+         * indexed by key type (int, float, double). 0 means not tuned: the
+         * value is then derived from the L2 size. Set by load_tuning() and
+         * autotune().
+         */
+        uint32_t tuned_way[3] = { 0, 0, 0 };
+
+        /**
+         * This method returns the slot of the key type in tuned_way.
+         *
+         */
         template <typename T>
-        void merger(T*& orig, uint32_t size)
+        uint32_t type_index()
         {
-            uint8_t stride;
-            uint32_t way;
-#ifdef __AVX__
+            if (std::is_same<T, float>::value)
+                return 1;
+            if (std::is_same<T, double>::value)
+                return 2;
+            return 0;
+        }
+
+        /**
+         * This method selects the number of segments merged per in-cache block.
+         * A tuned value wins; otherwise one block plus its merge buffer is sized
+         * to fill the L2 cache. If the L2 size is unknown the built-in default
+         * is kept.
+         *
+         * @param stride SIMD width of T
+         * @param fallback built-in default of the ISA
+         * @return a power of two
+         *
+         */
+        template <typename T>
+        uint32_t merge_way(uint8_t stride, uint32_t fallback)
+        {
+            if (tuned_way[type_index<T>()] != 0)
+                return tuned_way[type_index<T>()];
+
+            uint64_t l2 = util::cache_size(2);
+            if (l2 == 0)
+                return fallback;
+
+            uint64_t limit = l2 / (2 * stride * sizeof(T));
+            uint32_t way = 16;
+            while (way < 65536 && 2 * (uint64_t)way <= limit)
+                way *= 2;
+            return way;
+        }
+
+        /**
+         * This method returns the SIMD width of T and the number of stride-sized
+         * segments that merger() sorts in cache before its outer passes.
+         *
+         * @param stride SIMD width of T
+         * @param way segments per in-cache block
+         *
+         */
+        template <typename T>
+        void merger_params(uint8_t& stride, uint32_t& way)
+        {
+#if defined(__AVX__) || defined(__AVX2__)
             if (std::is_same<T, int>::value)
             {
                 stride = (uint8_t)simd_width::AVX_INT;
@@ -148,8 +246,55 @@ namespace aspas
                 way = 128;
             }
 #endif
+            way = merge_way<T>(stride, way);
+        }
+
+        /**
+         * This method merges the segments left by sorter() into one sorted
+         * array. Keys encoded by sorter() with tail.tf are decoded by the
+         * stores of the last pass, which also drops repeated keys if
+         * tail.unique is set or hands the keys to tail.sink.
+         *
+         * @param orig the partially sorted array
+         * @param size its size
+         * @param tail what the last pass does besides merging
+         * @return the size of the output: size, the number of distinct keys,
+         * or 0 with a sink
+         *
+         */
+        template <typename T>
+        uint32_t merger(T*& orig, uint32_t size, merge_tail tail = merge_tail())
+        {
+            const key_transform& tf = tail.tf;
+            uint32_t out_size = size;
+            uint8_t stride;
+            uint32_t way;
+            merger_params<T>(stride, way);
+
+            if (scratch_budget != 0 && (uint64_t)size * sizeof(T) > scratch_budget)
+            {
+                uint32_t cap = (uint32_t)(scratch_budget / sizeof(T));
+                T* buf = (T*)_mm_malloc(sizeof(T) * (std::max)(cap, (uint32_t)1), 64);
+                merger_bounded(orig, size, buf, cap);
+                _mm_free(buf);
+                // the in-place merges have no single last pass to fold this into
+                transform_keys(orig, size, tf, true);
+                if (tail.sink != nullptr)
+                {
+                    tail.sink(orig, size, tail.state);
+                    out_size = 0;
+                }
+                else if (tail.unique)
+                {
+                    T last;
+                    bool any = false;
+                    out_size = unique_copy(orig, size, orig, last, any, tail.counts, 0);
+                }
+                return out_size;
+            }
 
-            T* buf_array = new T[size];
+            // aligned so that streaming merges can use non-temporal stores
+            T* buf_array = (T*)_mm_malloc(sizeof(T) * size, 64);
             bool flip_flag = true;
             uint32_t i, j;
 
@@ -163,13 +308,14 @@ namespace aspas
                 flip_flag = true;
                 for (i = stride; i < block_size; i = 2 * i)
                 {
+                    merge_tail last = size <= block_size && 2 * i >= block_size ? tail : merge_tail();
                     if (flip_flag)
                     {
                         for (j = k; j < ((std::min))(k + block_size, size); j = j + 2 * i)
                         {
-                            merge(orig + j, ((std::min))(j + i, ((std::min))(k + block_size, size)) - j,
+                            out_size = merge_decode(orig + j, ((std::min))(j + i, ((std::min))(k + block_size, size)) - j,
                                 orig + ((std::min))(j + i, ((std::min))(k + block_size, size)), ((std::min))(j + 2 * i, ((std::min))(k + block_size, size)) - ((std::min))(j + i, ((std::min))(k + block_size, size)),
-                                buf_array + j);
+                                buf_array + j, false, last);
                         }
                         flip_flag = false;
                     }
@@ -177,9 +323,9 @@ namespace aspas
                     {
                         for (j = k; j < ((std::min))(k + block_size, size); j = j + 2 * i)
                         {
-                            merge(buf_array + j, ((std::min))(j + i, ((std::min))(k + block_size, size)) - j,
+                            out_size = merge_decode(buf_array + j, ((std::min))(j + i, ((std::min))(k + block_size, size)) - j,
                                 buf_array + ((std::min))(j + i, ((std::min))(k + block_size, size)), ((std::min))(j + 2 * i, ((std::min))(k + block_size, size)) - ((std::min))(j + i, ((std::min))(k + block_size, size)),
-                                orig + j);
+                                orig + j, false, last);
                         }
                         flip_flag = true;
                     }
@@ -208,15 +354,49 @@ namespace aspas
                 flip_flag = false;
             else
                 flip_flag = true;
-            for (i = block_size; i < size; i = 2 * i)
+
+            // once a pass (read + write) no longer fits in the last level cache,
+            // prefetch the inputs and bypass the cache on the output
+            bool stream = 2 * (uint64_t)size * sizeof(T) > util::llc_size();
+            if (stream)
             {
+                // out of cache every pass goes to DRAM, so merge fan_in runs per
+                // pass through the k-way tree instead of two
+                uint32_t fan_in = kway_fan_in<T>();
+                T** runs = new T*[fan_in];
+                uint32_t* lens = new uint32_t[fan_in];
+                for (uint64_t run = block_size; run < size; run *= fan_in)
+                {
+                    T* src = flip_flag ? orig : buf_array;
+                    T* dst = flip_flag ? buf_array : orig;
+                    for (uint64_t start = 0; start < size; start += run * fan_in)
+                    {
+                        uint32_t k = 0;
+                        for (uint64_t r = start; r < size && k < fan_in; r += run, k++)
+                        {
+                            runs[k] = src + r;
+                            lens[k] = (uint32_t)((std::min)(r + run, (uint64_t)size) - r);
+                        }
+                        if (run * fan_in >= size)
+                            out_size = kway_merge_decode(runs, lens, k, dst + start, true, tail);
+                        else
+                            kway_merge(runs, lens, k, dst + start, true);
+                    }
+                    flip_flag = !flip_flag;
+                }
+                delete[] runs;
+                delete[] lens;
+            }
+            else for (i = block_size; i < size; i = 2 * i)
+            {
+                merge_tail last = 2 * (uint64_t)i >= size ? tail : merge_tail();
                 if (flip_flag)
                 {
                     for (j = 0; j < size; j = j + 2 * i)
                     {
-                        merge(orig + j, ((std::min))(j + i, size) - j,
+                        out_size = merge_decode(orig + j, ((std::min))(j + i, size) - j,
                             orig + ((std::min))(j + i, size), ((std::min))(j + 2 * i, size) - ((std::min))(j + i, size),
-                            buf_array + j);
+                            buf_array + j, stream, last);
                     }
                     flip_flag = false;
                 }
@@ -224,16 +404,17 @@ namespace aspas
                 {
                     for (j = 0; j < size; j = j + 2 * i)
                     {
-                        merge(buf_array + j, ((std::min))(j + i, size) - j,
+                        out_size = merge_decode(buf_array + j, ((std::min))(j + i, size) - j,
                             buf_array + ((std::min))(j + i, size), ((std::min))(j + 2 * i, size) - ((std::min))(j + i, size),
-                            orig + j);
+                            orig + j, stream, last);
                     }
                     flip_flag = true;
                 }
             }
 
-            if (!flip_flag) std::copy(buf_array, buf_array + size, orig);// util::copy_array(orig, size, buf_array, size);
-            delete[] buf_array;
+            if (!flip_flag) std::copy(buf_array, buf_array + out_size, orig);// util::copy_array(orig, size, buf_array, size);
+            _mm_free(buf_array);
+            return out_size;
         }
 
        
@@ -0,0 +1,236 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file multiway.h
+ * Definition of the k-way merge engine. The k sorted runs are merged by a
+ * binary tree of 2-way SIMD merge nodes; every inner node owns a small FIFO
+ * that stays in cache, so the runs are read once and the output is written
+ * once no matter how many runs there are.
+ *
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+
+#include "aspas.h"
+#include "tools.h"
+
+namespace aspas
+{
+
+    namespace internal
+    {
+
+        /// size in bytes of the FIFO owned by every inner node of the merge tree
+        uint32_t kway_fifo_bytes = 32768;
+
+        /**
+         * A node of the k-way merge tree. For a leaf, data is the run itself;
+         * for an inner node, data is its FIFO. Elements [head, tail) are
+         * available; done is set once no element will follow tail.
+         */
+        template <typename T>
+        struct merge_node
+        {
+            T* data;
+            uint64_t head;
+            uint64_t tail;
+            bool done;
+        };
+
+        template <typename T>
+        void kway_refill(merge_node<T>* tree, uint32_t n, uint32_t fifo);
+
+        /**
+         * This method merges the children of node n into out, until cap elements
+         * are produced or both children are exhausted. Each step takes at most
+         * half of the room from either child, cuts the chunk at the smaller of
+         * the two chunk tails (everything up to it is known on both sides) and
+         * merges it with the SIMD merge kernel.
+         *
+         * @param tree merge tree, node 1 is the root and children of n are 2n, 2n+1
+         * @param n the node to produce from
+         * @param out the saving target
+         * @param cap maximum number of elements to produce
+         * @param fifo FIFO capacity of the inner nodes in elements
+         * @param stream enables prefetching and streaming stores on out
+         * @return number of elements produced
+         *
+         */
+        template <typename T>
+        uint64_t kway_fill(merge_node<T>* tree, uint32_t n, T* out, uint64_t cap, uint32_t fifo, bool stream)
+        {
+            merge_node<T>& l = tree[2 * n];
+            merge_node<T>& r = tree[2 * n + 1];
+            uint64_t produced = 0;
+
+            while (produced < cap)
+            {
+                if (l.head == l.tail && !l.done)
+                    kway_refill(tree, 2 * n, fifo);
+                if (r.head == r.tail && !r.done)
+                    kway_refill(tree, 2 * n + 1, fifo);
+
+                uint64_t na = l.tail - l.head;
+                uint64_t nb = r.tail - r.head;
+                // merge() counts in 32 bits
+                uint32_t room = (uint32_t)(std::min)(cap - produced, (uint64_t)1 << 31);
+                if (na == 0 && nb == 0)
+                    break;
+
+                // one child is drained for good: copy the other one through
+                if (na == 0 || nb == 0)
+                {
+                    merge_node<T>& s = na == 0 ? r : l;
+                    uint64_t cnt = (std::min)((uint64_t)room, s.tail - s.head);
+                    std::copy(s.data + s.head, s.data + s.head + cnt, out + produced);
+                    s.head += cnt;
+                    produced += cnt;
+                    continue;
+                }
+
+                T* a = l.data + l.head;
+                T* b = r.data + r.head;
+                if (room == 1)
+                {
+                    if (*a <= *b)
+                    {
+                        out[produced] = *a;
+                        l.head++;
+                    }
+                    else
+                    {
+                        out[produced] = *b;
+                        r.head++;
+                    }
+                    produced++;
+                    continue;
+                }
+
+                uint32_t ca = (uint32_t)(std::min)(na, (uint64_t)room / 2);
+                uint32_t cb = (uint32_t)(std::min)(nb, (uint64_t)room / 2);
+                // a chunk holding the last elements of its child bounds nothing
+                bool a_all = ca == na && l.done;
+                bool b_all = cb == nb && r.done;
+                if (!a_all && (b_all || a[ca - 1] <= b[cb - 1]))
+                    cb = (uint32_t)(std::upper_bound(b, b + cb, a[ca - 1]) - b);
+                else if (!b_all)
+                    ca = (uint32_t)(std::upper_bound(a, a + ca, b[cb - 1]) - a);
+
+                merge(a, ca, b, cb, out + produced, stream);
+                l.head += ca;
+                r.head += cb;
+                produced += ca + cb;
+            }
+            return produced;
+        }
+
+        /**
+         * This method refills the (empty) FIFO of inner node n from its children.
+         *
+         * @param tree merge tree
+         * @param n the inner node to refill
+         * @param fifo FIFO capacity in elements
+         *
+         */
+        template <typename T>
+        void kway_refill(merge_node<T>* tree, uint32_t n, uint32_t fifo)
+        {
+            merge_node<T>& node = tree[n];
+            merge_node<T>& l = tree[2 * n];
+            merge_node<T>& r = tree[2 * n + 1];
+
+            node.head = 0;
+            node.tail = kway_fill(tree, n, node.data, fifo, fifo, false);
+            node.done = l.done && l.head == l.tail && r.done && r.head == r.tail;
+        }
+
+        /**
+         * This method returns the fan-in of the merge tree: the largest power of
+         * two whose inner FIFOs together take at most half of the L2 cache.
+         *
+         */
+        template <typename T>
+        uint32_t kway_fan_in()
+        {
+            uint64_t l2 = util::cache_size(2);
+            if (l2 == 0)
+                l2 = 256 << 10;
+
+            uint32_t k = 2;
+            while (k < 1024 && 2 * (uint64_t)k * kway_fifo_bytes <= l2 / 2)
+                k *= 2;
+            return k;
+        }
+
+        /**
+         * This method merges k sorted runs into output in a single pass.
+         *
+         * @param runs pointers to the first element of each run
+         * @param lens the size of each run
+         * @param k number of runs
+         * @param output the saving target, sum of lens elements
+         * @param stream enables prefetching and streaming stores on output
+         *
+         */
+        template <typename T, typename L>
+        void kway_merge(T* const* runs, const L* lens, uint32_t k, T* output, bool stream)
+        {
+            if (k == 0)
+                return;
+            if (k == 1)
+            {
+                std::copy(runs[0], runs[0] + lens[0], output);
+                return;
+            }
+
+            uint32_t leaves = 2;
+            while (leaves < k)
+                leaves *= 2;
+            uint32_t fifo = (std::max)(kway_fifo_bytes / (uint32_t)sizeof(T), (uint32_t)64);
+
+            merge_node<T>* tree = new merge_node<T>[2 * leaves];
+            T* fifos = (T*)_mm_malloc(sizeof(T) * fifo * leaves, 64);
+
+            for (uint32_t n = 1; n < leaves; n++)
+            {
+                tree[n].data = fifos + n * fifo;
+                tree[n].head = 0;
+                tree[n].tail = 0;
+                tree[n].done = false;
+            }
+            uint64_t total = 0;
+            for (uint32_t i = 0; i < leaves; i++)
+            {
+                tree[leaves + i].data = i < k ? runs[i] : NULL;
+                tree[leaves + i].head = 0;
+                tree[leaves + i].tail = i < k ? lens[i] : 0;
+                tree[leaves + i].done = true;
+                total += i < k ? lens[i] : 0;
+            }
+
+            kway_fill(tree, 1, output, total, fifo, stream);
+
+            _mm_free(fifos);
+            delete[] tree;
+        }
+
+    }
+
+}
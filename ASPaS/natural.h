@@ -0,0 +1,243 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file natural.h
+ * Detection of the runs already present in the input of sort(). Ascending
+ * runs and (reversed) descending runs of at least one merger block are kept
+ * as they are; only the stretches between them go through the sorter and the
+ * merger, and the runs are then merged with merge_adaptive().
+ *
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+
+#include "aspas.h"
+#include "tools.h"
+
+namespace aspas
+{
+
+    namespace internal
+    {
+
+        /**
+         * Integer version: <br>
+         * This method returns the length of the run at the head of p, i.e. the
+         * number of leading elements in non-decreasing (or non-increasing)
+         * order. Eight adjacent pairs are compared per step.
+         *
+         * @param p the first element of the run
+         * @param n number of elements available
+         * @param descending look for a non-increasing run
+         * @return the run length, n if the whole input is one run
+         *
+         */
+        uint32_t run_length(int* p, uint32_t n, bool descending)
+        {
+            uint32_t i;
+            for (i = 0; i + 9 <= n; i += 8)
+            {
+                __m256i a = _mm256_loadu_si256((__m256i*)(p + i));
+                __m256i b = _mm256_loadu_si256((__m256i*)(p + i + 1));
+                // lanes where the order breaks between p[j] and p[j + 1]
+                __m256i brk = descending ? _mm256_cmpgt_epi32(b, a) : _mm256_cmpgt_epi32(a, b);
+                uint32_t mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(brk));
+                if (mask != 0)
+                    return i + util::ctz(mask) + 1;
+            }
+            for (; i + 1 < n; i++)
+                if (descending ? p[i + 1] > p[i] : p[i] > p[i + 1])
+                    return i + 1;
+            return n;
+        }
+
+        /**
+         * Float version: <br>
+         * This method returns the length of the run at the head of p.
+         *
+         * @param p the first element of the run
+         * @param n number of elements available
+         * @param descending look for a non-increasing run
+         * @return the run length, n if the whole input is one run
+         *
+         */
+        uint32_t run_length(float* p, uint32_t n, bool descending)
+        {
+            uint32_t i;
+            for (i = 0; i + 9 <= n; i += 8)
+            {
+                __m256 a = _mm256_loadu_ps(p + i);
+                __m256 b = _mm256_loadu_ps(p + i + 1);
+                __m256 brk = descending ? _mm256_cmp_ps(b, a, _CMP_GT_OQ) : _mm256_cmp_ps(a, b, _CMP_GT_OQ);
+                uint32_t mask = (uint32_t)_mm256_movemask_ps(brk);
+                if (mask != 0)
+                    return i + util::ctz(mask) + 1;
+            }
+            for (; i + 1 < n; i++)
+                if (descending ? p[i + 1] > p[i] : p[i] > p[i + 1])
+                    return i + 1;
+            return n;
+        }
+
+        /**
+         * Double version: <br>
+         * This method returns the length of the run at the head of p.
+         *
+         * @param p the first element of the run
+         * @param n number of elements available
+         * @param descending look for a non-increasing run
+         * @return the run length, n if the whole input is one run
+         *
+         */
+        uint32_t run_length(double* p, uint32_t n, bool descending)
+        {
+            uint32_t i;
+            for (i = 0; i + 5 <= n; i += 4)
+            {
+                __m256d a = _mm256_loadu_pd(p + i);
+                __m256d b = _mm256_loadu_pd(p + i + 1);
+                __m256d brk = descending ? _mm256_cmp_pd(b, a, _CMP_GT_OQ) : _mm256_cmp_pd(a, b, _CMP_GT_OQ);
+                uint32_t mask = (uint32_t)_mm256_movemask_pd(brk);
+                if (mask != 0)
+                    return i + util::ctz(mask) + 1;
+            }
+            for (; i + 1 < n; i++)
+                if (descending ? p[i + 1] > p[i] : p[i] > p[i + 1])
+                    return i + 1;
+            return n;
+        }
+
+        /**
+         * This method sorts array while keeping the runs already present in it.
+         * Runs are looked for at block granularity: a block whose head starts
+         * an ascending or descending run of at least one merger block (or of
+         * the whole input) is kept, and descending runs are reversed in place.
+         * The stretches between kept runs are sorted by sort_direct(), and all
+         * runs are then merged pairwise with merge_adaptive(),
+         * which copies the parts where neighbouring runs do not overlap.
+         *
+         * @param array the pointer to the first element of the input array
+         * @param size the size of the input array
+         *
+         */
+        template <class T>
+        void natural_sort(T* array, uint32_t size)
+        {
+            uint8_t stride;
+            uint32_t way;
+            merger_params<T>(stride, way);
+            uint32_t block = stride * way;
+
+            // kept runs and the gaps between them alternate, so at most 2 per block
+            uint32_t* bounds = new uint32_t[2 * (size / block) + 3];
+            uint32_t runs = 0;
+            uint32_t gap = 0;
+            uint32_t i = 0;
+            bounds[0] = 0;
+
+            while (i < size)
+            {
+                uint32_t len = run_length(array + i, size - i, false);
+                if (len < block && len < size)
+                {
+                    uint32_t desc = run_length(array + i, size - i, true);
+                    if (desc >= block || desc == size)
+                    {
+                        std::reverse(array + i, array + i + desc);
+                        len = desc;
+                    }
+                }
+                if (len < block && len < size)
+                {
+                    i = (std::min)(size - i, block) + i;
+                    continue;
+                }
+
+                // sort the gap in front of the run, then keep the run itself
+                if (gap < i)
+                {
+                    sort_direct(array + gap, i - gap);
+                    bounds[++runs] = i;
+                }
+                i += len;
+                bounds[++runs] = i;
+                gap = i;
+            }
+            // without any kept run this sorts the whole input
+            if (gap < size)
+            {
+                sort_direct(array + gap, size - gap);
+                bounds[++runs] = size;
+            }
+
+            if (runs > 1 && scratch_budget != 0 && (uint64_t)size * sizeof(T) > scratch_budget)
+            {
+                // no room for a second copy: merge neighbouring runs in place
+                uint32_t cap = (uint32_t)(scratch_budget / sizeof(T));
+                T* buf = (T*)_mm_malloc(sizeof(T) * (std::max)(cap, (uint32_t)1), 64);
+                while (runs > 1)
+                {
+                    uint32_t merged = 0;
+                    for (uint32_t r = 0; r < runs; r += 2)
+                    {
+                        if (r + 1 < runs)
+                            merge_bounded(array + bounds[r], bounds[r + 1] - bounds[r], bounds[r + 2] - bounds[r + 1], buf, cap);
+                        bounds[merged++] = bounds[r];
+                    }
+                    bounds[merged] = size;
+                    runs = merged;
+                }
+                _mm_free(buf);
+            }
+            else if (runs > 1)
+            {
+                T* buf = (T*)_mm_malloc(sizeof(T) * size, 64);
+                bool stream = 2 * (uint64_t)size * sizeof(T) > util::llc_size();
+                T* src = array;
+                T* dst = buf;
+                while (runs > 1)
+                {
+                    uint32_t merged = 0;
+                    uint32_t r;
+                    for (r = 0; r + 1 < runs; r += 2)
+                    {
+                        merge_adaptive(src + bounds[r], bounds[r + 1] - bounds[r],
+                            src + bounds[r + 1], bounds[r + 2] - bounds[r + 1], dst + bounds[r]);
+                        bounds[merged++] = bounds[r];
+                    }
+                    if (r < runs)
+                    {
+                        util::copy_stream(dst + bounds[r], src + bounds[r], bounds[r + 1] - bounds[r], stream);
+                        bounds[merged++] = bounds[r];
+                    }
+                    bounds[merged] = size;
+                    runs = merged;
+                    std::swap(src, dst);
+                }
+                if (src != array)
+                    util::copy_stream(array, src, size, stream);
+                _mm_free(buf);
+            }
+            delete[] bounds;
+        }
+
+    }
+
+}
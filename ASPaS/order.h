@@ -0,0 +1,311 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file order.h
+ * Definition of sorting in a given key order (keys.h). sorter() encodes the
+ * keys as it loads them and the last merge pass of merger() decodes them:
+ * that pass merges an L2-sized tile at a time, split by co-rank, and decodes
+ * the tile on its way to the output.
+ *
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+
+#include "aspas.h"
+#include "keys.h"
+
+namespace aspas
+{
+
+    namespace internal
+    {
+
+        /// elements merged per tile by the decoding last pass
+        const uint32_t order_tile = 1 << 14;
+
+        /**
+         * This method stores a merged tile at output + written: decoded, or
+         * with its repeated keys dropped and the rest decoded in place. A
+         * sink takes the tile instead.
+         *
+         */
+        template <typename T>
+        void store_tile(T* output, uint32_t& written, const T* tile, uint32_t n, bool stream, merge_tail tail, T& last, bool& any)
+        {
+            if (tail.sink != nullptr)
+            {
+                tail.sink(tile, n, tail.state);
+                return;
+            }
+            if (!tail.unique)
+            {
+                decode_copy(output + written, tile, n, tail.tf, stream);
+                written += n;
+                return;
+            }
+            uint32_t kept = unique_copy(tile, n, output + written, last, any, tail.counts, written);
+            transform_keys(output + written, kept, tail.tf, true);
+            written += kept;
+        }
+
+        /**
+         * This method merges inputA and inputB into output and decodes the
+         * keys with tail.tf, tile by tile so that every key is decoded while
+         * still in cache; with tail.unique it drops the repeated keys of the
+         * tiles on the way as well, and with tail.sink it hands the tiles
+         * over instead of storing them. Without any it is merge().
+         *
+         * @return the number of keys stored
+         *
+         */
+        template <typename T>
+        uint32_t merge_decode(T* inputA, uint32_t sizeA, T* inputB, uint32_t sizeB, T* output, bool stream, merge_tail tail)
+        {
+            if (tail.tf.op == key_op::NONE && !tail.unique && tail.sink == nullptr)
+            {
+                merge(inputA, sizeA, inputB, sizeB, output, stream);
+                return sizeA + sizeB;
+            }
+
+            T* tile = (T*)_mm_malloc(sizeof(T) * order_tile, 64);
+            uint32_t size = sizeA + sizeB;
+            uint32_t a0 = 0, b0 = 0;
+            uint32_t written = 0;
+            T last;
+            bool any = false;
+            for (uint32_t t = 0; t < size; t += order_tile)
+            {
+                uint32_t n = (std::min)(order_tile, size - t);
+                uint32_t a1, b1;
+                find_corank(inputA, sizeA, inputB, sizeB, t + n, a1, b1);
+                merge(inputA + a0, a1 - a0, inputB + b0, b1 - b0, tile, false);
+                store_tile(output, written, tile, n, stream, tail, last, any);
+                a0 = a1;
+                b0 = b1;
+            }
+            _mm_free(tile);
+            return written;
+        }
+
+        /**
+         * This method k-way merges the runs into output like merge_decode(),
+         * the tiles split with find_kth_multi. Without a transform, unique
+         * or sink it is kway_merge().
+         *
+         * @return the number of keys stored
+         *
+         */
+        template <typename T>
+        uint32_t kway_merge_decode(T* const* runs, const uint32_t* lens, uint32_t k, T* output, bool stream, merge_tail tail)
+        {
+            if (tail.tf.op == key_op::NONE && !tail.unique && tail.sink == nullptr)
+            {
+                kway_merge(runs, lens, k, output, stream);
+                uint32_t size = 0;
+                for (uint32_t i = 0; i < k; i++)
+                    size += lens[i];
+                return size;
+            }
+
+            size_t* len = new size_t[k];
+            size_t* lo = new size_t[k];
+            size_t* hi = new size_t[k];
+            T** sub = new T*[k];
+            uint32_t* sub_len = new uint32_t[k];
+            uint64_t total = 0;
+            for (uint32_t i = 0; i < k; i++)
+            {
+                len[i] = lens[i];
+                lo[i] = 0;
+                total += lens[i];
+            }
+
+            T* tile = (T*)_mm_malloc(sizeof(T) * order_tile, 64);
+            uint32_t written = 0;
+            T last;
+            bool any = false;
+            for (uint64_t t = 0; t < total; t += order_tile)
+            {
+                uint32_t n = (uint32_t)(std::min)((uint64_t)order_tile, total - t);
+                find_kth_multi(runs, len, k, t + n, hi);
+                for (uint32_t i = 0; i < k; i++)
+                {
+                    sub[i] = runs[i] + lo[i];
+                    sub_len[i] = (uint32_t)(hi[i] - lo[i]);
+                    lo[i] = hi[i];
+                }
+                kway_merge(sub, sub_len, k, tile, false);
+                store_tile(output, written, tile, n, stream, tail, last, any);
+            }
+            _mm_free(tile);
+
+            delete[] len;
+            delete[] lo;
+            delete[] hi;
+            delete[] sub;
+            delete[] sub_len;
+            return written;
+        }
+
+        /**
+         * This method sorts the input in the order given by tf with the
+         * sorter and merger.
+         *
+         */
+        template <class T>
+        void sort_ordered(T* array, uint32_t size, key_transform tf)
+        {
+            sorter(array, size, tf);
+            merger(array, size, tf);
+        }
+
+        /**
+         * This method sorts doubles by absolute value or in total order. The
+         * kernels have no 64-bit integer lanes, so the keys are mapped to
+         * unsigned integers for the radix engine, at one pass each way.
+         *
+         */
+        inline void sort_double_bits(double* array, uint32_t size, bool total)
+        {
+            const uint64_t sign = 0x8000000000000000ull;
+            uint64_t* bits = (uint64_t*)array;
+            for (uint32_t i = 0; i < size; i++)
+            {
+                uint64_t b = bits[i];
+                bits[i] = total ? b ^ ((uint64_t)((int64_t)b >> 63) | sign) : ((b << 1) | (b >> 63)) ^ 1;
+            }
+            radix_sort(bits, size);
+            for (uint32_t i = 0; i < size; i++)
+            {
+                uint64_t e = bits[i];
+                bits[i] = total ? ((e & sign) ? e ^ sign : ~e) : ((e ^ 1) >> 1) | ((e ^ 1) << 63);
+            }
+        }
+
+    }
+
+    /**
+     * Integer version: <br>
+     * This method sorts the given input array in the given key order. The order is applied
+     * as the sorter loads the keys and as the last merge pass stores them, so it costs no
+     * extra pass over the array.
+     *
+     * @param array the pointer to the first element of the input array
+     * @param size the size of the input array
+     * @param order the key order; TOTAL is ASCENDING
+     * @return the sorted elements are stored in the pointer of array
+     *
+     */
+     //! This method sorts the given input array in the given key order.
+    inline void sort(int* array, uint32_t size, key_order order)
+    {
+        switch (order)
+        {
+        case key_order::DESCENDING:
+            internal::sort_ordered(array, size, internal::key_transform(internal::key_op::XOR, ~0ull));
+            break;
+        case key_order::ABS:
+            internal::sort_ordered(array, size, internal::key_transform(internal::key_op::ZIGZAG));
+            break;
+        default:
+            sort(array, size);
+        }
+    }
+
+    /**
+     * Unsigned integer version: <br>
+     * This method sorts the given input array as unsigned keys, biased onto the signed
+     * integer kernels as they are loaded and stored.
+     *
+     * @param array the pointer to the first element of the input array
+     * @param size the size of the input array
+     * @param order ASCENDING or DESCENDING; ABS and TOTAL are ASCENDING
+     * @return the sorted elements are stored in the pointer of array
+     *
+     */
+     //! This method sorts the given unsigned input array.
+    inline void sort(uint32_t* array, uint32_t size, key_order order = key_order::ASCENDING)
+    {
+        int* keys = (int*)array;
+        uint64_t mask = order == key_order::DESCENDING ? 0x7fffffff7fffffffull : 0x8000000080000000ull;
+        internal::sort_ordered(keys, size, internal::key_transform(internal::key_op::XOR, mask));
+    }
+
+    /**
+     * Float version: <br>
+     * This method sorts the given input array in the given key order. ABS and TOTAL sort
+     * the bit patterns on the integer kernels, so NaNs are ordered as well: by TOTAL the
+     * negative ones first and the positive ones last, by ABS after the infinities.
+     *
+     * @param array the pointer to the first element of the input array
+     * @param size the size of the input array
+     * @param order the key order
+     * @return the sorted elements are stored in the pointer of array
+     *
+     */
+     //! This method sorts the given input array in the given key order.
+    inline void sort(float* array, uint32_t size, key_order order)
+    {
+        int* bits = (int*)array;
+        switch (order)
+        {
+        case key_order::DESCENDING:
+            internal::sort_ordered(array, size, internal::key_transform(internal::key_op::XOR, 0x8000000080000000ull));
+            break;
+        case key_order::ABS:
+            internal::sort_ordered(bits, size, internal::key_transform(internal::key_op::ROTATE));
+            break;
+        case key_order::TOTAL:
+            internal::sort_ordered(bits, size, internal::key_transform(internal::key_op::FLIP));
+            break;
+        default:
+            sort(array, size);
+        }
+    }
+
+    /**
+     * Double version: <br>
+     * This method sorts the given input array in the given key order. ABS and TOTAL go
+     * through the 64-bit radix engine with one encoding and one decoding pass.
+     *
+     * @param array the pointer to the first element of the input array
+     * @param size the size of the input array
+     * @param order the key order
+     * @return the sorted elements are stored in the pointer of array
+     *
+     */
+     //! This method sorts the given input array in the given key order.
+    inline void sort(double* array, uint32_t size, key_order order)
+    {
+        switch (order)
+        {
+        case key_order::DESCENDING:
+            internal::sort_ordered(array, size, internal::key_transform(internal::key_op::XOR, 0x8000000000000000ull));
+            break;
+        case key_order::ABS:
+        case key_order::TOTAL:
+            internal::sort_double_bits(array, size, order == key_order::TOTAL);
+            break;
+        default:
+            sort(array, size);
+        }
+    }
+
+}
@@ -0,0 +1,462 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file permute.h
+ * Definition of applying a permutation to columns: output[i] = input[perm[i]].
+ * Columns that fit in the last level cache are gathered directly, with AVX2
+ * gathers for 4- and 8-byte elements and software prefetch ahead of them.
+ * Several larger columns go through a partitioned plan built once per
+ * permutation: perm is grouped by source range (a radix partition on its
+ * high bits), so that every column is applied as two gathers, one reading a
+ * cache-sized source range at a time and one reading a few sequential
+ * streams.
+ *
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+
+#include "aspas.h"
+#include "tools.h"
+
+namespace aspas
+{
+
+    namespace internal
+    {
+
+        /// perm entries between an element's prefetch and its copy
+        const uint32_t permute_prefetch = 64;
+
+        /// perm entries applied to every column before the next ones, in the multi-column pass
+        const uint32_t permute_chunk = 1 << 12;
+
+        /// fewest perm entries per thread
+        const uint32_t permute_parallel_min = 1 << 16;
+
+        /// most buckets of a partitioned plan; past this the second gather has too many streams
+        const uint32_t permute_buckets = 64;
+
+        /**
+         * Columns of more bytes than this are applied through the partitioned
+         * plan when there are several of them. 0, the default, takes
+         * eight times the size of the last level cache.
+         */
+        uint64_t permute_partition_bytes = 0;
+
+        /**
+         * This method gathers output[begin..end) = input[idx[begin..end)],
+         * prefetching the sources permute_prefetch entries ahead if
+         * prefetch is set.
+         *
+         */
+        template <class T>
+        void gather_range(const T* input, const uint32_t* idx, uint32_t begin, uint32_t end, T* output, bool prefetch)
+        {
+            uint32_t i = begin;
+            if (prefetch)
+            {
+                for (/* cont'd */; i + permute_prefetch < end; i++)
+                {
+                    _mm_prefetch((const char*)(input + idx[i + permute_prefetch]), _MM_HINT_T0);
+                    output[i] = input[idx[i]];
+                }
+            }
+            for (/* cont'd */; i < end; i++)
+                output[i] = input[idx[i]];
+        }
+
+        /**
+         * 4-byte version: eight elements per AVX2 gather. The indices are
+         * signed, so input must have fewer than 2^31 elements.
+         *
+         */
+        inline void gather_range(const uint32_t* input, const uint32_t* idx, uint32_t begin, uint32_t end, uint32_t* output, bool prefetch)
+        {
+            uint32_t i = begin;
+            for (/* cont'd */; i + 8 <= end; i += 8)
+            {
+                if (prefetch && i + permute_prefetch + 8 <= end)
+                {
+                    const uint32_t* ahead = idx + i + permute_prefetch;
+                    for (uint32_t j = 0; j < 8; j++)
+                        _mm_prefetch((const char*)(input + ahead[j]), _MM_HINT_T0);
+                }
+                __m256i v = _mm256_loadu_si256((const __m256i*)(idx + i));
+                _mm256_storeu_si256((__m256i*)(output + i), _mm256_i32gather_epi32((const int*)input, v, 4));
+            }
+            for (/* cont'd */; i < end; i++)
+                output[i] = input[idx[i]];
+        }
+
+        /**
+         * 8-byte version: four elements per AVX2 gather.
+         *
+         */
+        inline void gather_range(const uint64_t* input, const uint32_t* idx, uint32_t begin, uint32_t end, uint64_t* output, bool prefetch)
+        {
+            uint32_t i = begin;
+            for (/* cont'd */; i + 4 <= end; i += 4)
+            {
+                if (prefetch && i + permute_prefetch + 4 <= end)
+                {
+                    const uint32_t* ahead = idx + i + permute_prefetch;
+                    for (uint32_t j = 0; j < 4; j++)
+                        _mm_prefetch((const char*)(input + ahead[j]), _MM_HINT_T0);
+                }
+                __m128i v = _mm_loadu_si128((const __m128i*)(idx + i));
+                _mm256_storeu_si256((__m256i*)(output + i), _mm256_i32gather_epi64((const long long*)input, v, 8));
+            }
+            for (/* cont'd */; i < end; i++)
+                output[i] = input[idx[i]];
+        }
+
+        /**
+         * This method gathers a column of width bytes, picking the kernel of
+         * that width: the AVX2 ones below 2^31 elements, the scalar one
+         * otherwise.
+         *
+         */
+        inline void gather_column(const void* input, uint32_t width, const uint32_t* idx, uint32_t begin, uint32_t end,
+            void* output, uint32_t size, bool prefetch)
+        {
+            bool vector = size <= 0x7fffffffu;
+            switch (width)
+            {
+            case 1:
+                gather_range((const uint8_t*)input, idx, begin, end, (uint8_t*)output, prefetch);
+                break;
+            case 2:
+                gather_range((const uint16_t*)input, idx, begin, end, (uint16_t*)output, prefetch);
+                break;
+            case 4:
+                if (vector)
+                    gather_range((const uint32_t*)input, idx, begin, end, (uint32_t*)output, prefetch);
+                else
+                    gather_range<uint32_t>((const uint32_t*)input, idx, begin, end, (uint32_t*)output, prefetch);
+                break;
+            default:
+                if (vector)
+                    gather_range((const uint64_t*)input, idx, begin, end, (uint64_t*)output, prefetch);
+                else
+                    gather_range<uint64_t>((const uint64_t*)input, idx, begin, end, (uint64_t*)output, prefetch);
+            }
+        }
+
+        /**
+         * A partitioned plan of a permutation. source is perm grouped by
+         * the bucket (high bits) of its entries, in perm order within a
+         * bucket, and position[i] is where perm[i] went in source. A column
+         * is then applied as staged[j] = input[source[j]], which reads one
+         * bucket of input at a time, and output[i] = staged[position[i]],
+         * which reads one sequential stream per bucket.
+         */
+        struct permute_plan
+        {
+            uint32_t* source;
+            uint32_t* position;
+            uint32_t shift;
+            uint32_t buckets;
+        };
+
+        struct args_permute
+        {
+            const uint32_t* perm;
+            uint32_t size;
+            uint32_t begin;
+            uint32_t end;
+            // plan building
+            permute_plan* plan;
+            uint32_t* count;
+            // column gathers
+            uint32_t k;
+            const void* const* inputs;
+            const uint32_t* widths;
+            void* const* outputs;
+            bool prefetch;
+        };
+
+        /**
+         * This method returns the column size in bytes above which the
+         * partitioned plan is used.
+         *
+         */
+        inline uint64_t permute_threshold()
+        {
+            return permute_partition_bytes != 0 ? permute_partition_bytes : 8 * util::llc_size();
+        }
+
+        /**
+         * This method runs kernel on args[0..threads), each given an even
+         * share of [0, size).
+         *
+         */
+        inline void permute_pass(void (*kernel)(void*), args_permute* args, uint32_t size, uint32_t threads)
+        {
+            std::thread* workers = new std::thread[threads];
+            for (uint32_t t = 0; t < threads; t++)
+            {
+                args[t].begin = (uint32_t)((uint64_t)size * t / threads);
+                args[t].end = (uint32_t)((uint64_t)size * (t + 1) / threads);
+                if (threads > 1)
+                    workers[t] = std::thread(kernel, &args[t]);
+            }
+            if (threads > 1)
+                for (uint32_t t = 0; t < threads; t++)
+                    workers[t].join();
+            else
+                kernel(&args[0]);
+            delete[] workers;
+        }
+
+        /**
+         * This method runs kernel with every thread given a copy of proto.
+         *
+         */
+        inline void permute_pass(void (*kernel)(void*), const args_permute& proto, uint32_t size, uint32_t threads, args_permute* args)
+        {
+            for (uint32_t t = 0; t < threads; t++)
+                args[t] = proto;
+            permute_pass(kernel, args, size, threads);
+        }
+
+        inline void thread_count_kernel(void* arguments)
+        {
+            args_permute* args = (args_permute*)arguments;
+            uint32_t shift = args->plan->shift;
+            for (uint32_t i = args->begin; i < args->end; i++)
+                args->count[args->perm[i] >> shift]++;
+        }
+
+        inline void thread_partition_kernel(void* arguments)
+        {
+            args_permute* args = (args_permute*)arguments;
+            permute_plan* plan = args->plan;
+            for (uint32_t i = args->begin; i < args->end; i++)
+            {
+                uint32_t p = args->perm[i];
+                uint32_t j = args->count[p >> plan->shift]++;
+                plan->source[j] = p;
+                plan->position[i] = j;
+            }
+        }
+
+        /**
+         * This method applies perm[begin..end) to every column, a chunk of
+         * perm at a time, so that perm is read once for all columns.
+         *
+         */
+        inline void thread_gather_kernel(void* arguments)
+        {
+            args_permute* args = (args_permute*)arguments;
+            for (uint32_t c = args->begin; c < args->end; c += permute_chunk)
+            {
+                uint32_t end = (std::min)(c + permute_chunk, args->end);
+                for (uint32_t col = 0; col < args->k; col++)
+                    gather_column(args->inputs[col], args->widths[col], args->perm, c, end,
+                        args->outputs[col], args->size, args->prefetch);
+            }
+        }
+
+        /**
+         * This method builds the partitioned plan of perm with buckets of
+         * 2^shift source elements: a histogram pass and a stable scatter
+         * pass, each split across threads with one histogram per thread.
+         *
+         */
+        inline void build_plan(const uint32_t* perm, uint32_t size, uint32_t shift, uint32_t threads, permute_plan& plan)
+        {
+            plan.shift = shift;
+            plan.buckets = (uint32_t)(((uint64_t)size + (1ull << shift) - 1) >> shift);
+            plan.source = (uint32_t*)_mm_malloc(sizeof(uint32_t) * (uint64_t)size, 64);
+            plan.position = (uint32_t*)_mm_malloc(sizeof(uint32_t) * (uint64_t)size, 64);
+
+            uint32_t* count = new uint32_t[(uint64_t)threads * plan.buckets]();
+            args_permute* args = new args_permute[threads];
+            args_permute proto = args_permute();
+            proto.perm = perm;
+            proto.size = size;
+            proto.plan = &plan;
+
+            // one histogram per thread, then each thread's start in every bucket
+            for (uint32_t t = 0; t < threads; t++)
+            {
+                args[t] = proto;
+                args[t].count = count + (uint64_t)t * plan.buckets;
+            }
+            permute_pass(thread_count_kernel, args, size, threads);
+            uint32_t sum = 0;
+            for (uint32_t b = 0; b < plan.buckets; b++)
+            {
+                for (uint32_t t = 0; t < threads; t++)
+                {
+                    uint32_t c = args[t].count[b];
+                    args[t].count[b] = sum;
+                    sum += c;
+                }
+            }
+            permute_pass(thread_partition_kernel, args, size, threads);
+
+            delete[] args;
+            delete[] count;
+        }
+
+        /**
+         * This method applies perm to k columns of the given widths (1, 2, 4
+         * or 8 bytes) with the given number of threads.
+         *
+         */
+        inline void apply_permutation(const void* const* inputs, const uint32_t* widths, uint32_t k,
+            const uint32_t* perm, uint32_t size, void* const* outputs, uint32_t threads)
+        {
+            if (size == 0 || k == 0)
+                return;
+            threads = (std::max)((std::min)(threads, size / permute_parallel_min), (uint32_t)1);
+
+            uint32_t widest = 1;
+            for (uint32_t col = 0; col < k; col++)
+                widest = (std::max)(widest, widths[col]);
+            uint64_t threshold = permute_threshold();
+
+            args_permute proto = args_permute();
+            proto.size = size;
+            args_permute* args = new args_permute[threads];
+
+            // the plan costs about half a direct gather and saves about as much per column
+            if ((uint64_t)size * widest <= threshold || k < 2)
+            {
+                proto.perm = perm;
+                proto.k = k;
+                proto.inputs = inputs;
+                proto.widths = widths;
+                proto.outputs = outputs;
+                proto.prefetch = (uint64_t)size * widest > util::cache_size(2);
+                permute_pass(thread_gather_kernel, proto, size, threads, args);
+                delete[] args;
+                return;
+            }
+
+            // buckets of half the cache of the widest column, fewer if that makes too many
+            uint64_t span = util::llc_size() / (2 * (uint64_t)widest);
+            uint32_t shift = 0;
+            while ((2ull << shift) <= span || ((uint64_t)size >> shift) >= permute_buckets)
+                shift++;
+
+            permute_plan plan;
+            build_plan(perm, size, shift, threads, plan);
+            void* staged = _mm_malloc((uint64_t)size * widest, 64);
+
+            for (uint32_t col = 0; col < k; col++)
+            {
+                proto.k = 1;
+                proto.widths = widths + col;
+                proto.prefetch = false;
+
+                proto.perm = plan.source;
+                proto.inputs = inputs + col;
+                proto.outputs = &staged;
+                permute_pass(thread_gather_kernel, proto, size, threads, args);
+
+                proto.perm = plan.position;
+                proto.inputs = (const void* const*)&staged;
+                proto.outputs = outputs + col;
+                permute_pass(thread_gather_kernel, proto, size, threads, args);
+            }
+
+            _mm_free(staged);
+            _mm_free(plan.source);
+            _mm_free(plan.position);
+            delete[] args;
+        }
+
+    }
+
+    /**
+     * This method applies the permutation perm to the given column: output[i] = input[perm[i]].
+     * The elements can be of any type of 1, 2, 4 or 8 bytes.
+     *
+     * @param input the pointer to the first element of the column
+     * @param perm the permutation, size indices into input
+     * @param size the number of elements
+     * @param output the saving target of the permuted column; must not overlap input
+     *
+     */
+     //! This method applies a permutation to the given column.
+    template <class T>
+    void apply_permutation(const T* input, const uint32_t* perm, uint32_t size, T* output)
+    {
+        static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8, "1, 2, 4 or 8-byte elements");
+        const void* inputs[1] = { input };
+        void* outputs[1] = { output };
+        uint32_t widths[1] = { sizeof(T) };
+        internal::apply_permutation(inputs, widths, 1, perm, size, outputs, 1);
+    }
+
+    /**
+     * This method applies the permutation perm to the given column with thread_num threads.
+     *
+     * @param input the pointer to the first element of the column
+     * @param perm the permutation, size indices into input
+     * @param size the number of elements
+     * @param output the saving target of the permuted column; must not overlap input
+     *
+     */
+     //! This method applies a permutation to the given column with multiple threads.
+    template <class T>
+    void parallel_apply_permutation(const T* input, const uint32_t* perm, uint32_t size, T* output)
+    {
+        static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8, "1, 2, 4 or 8-byte elements");
+        const void* inputs[1] = { input };
+        void* outputs[1] = { output };
+        uint32_t widths[1] = { sizeof(T) };
+        internal::apply_permutation(inputs, widths, 1, perm, size, outputs, thread_num);
+    }
+
+    /**
+     * This method applies the permutation perm to k columns at once: outputs[c][i] =
+     * inputs[c][perm[i]]. perm is read once for all of them.
+     *
+     * @param inputs the pointers to the first element of every column
+     * @param widths the element size of every column: 1, 2, 4 or 8 bytes
+     * @param k the number of columns
+     * @param perm the permutation, size indices into every column
+     * @param size the number of elements per column
+     * @param outputs the saving targets of the permuted columns
+     *
+     */
+     //! This method applies a permutation to several columns.
+    inline void apply_permutation(const void* const* inputs, const uint32_t* widths, uint32_t k,
+        const uint32_t* perm, uint32_t size, void* const* outputs)
+    {
+        internal::apply_permutation(inputs, widths, k, perm, size, outputs, 1);
+    }
+
+    /**
+     * This method applies the permutation perm to k columns at once with thread_num threads.
+     *
+     */
+     //! This method applies a permutation to several columns with multiple threads.
+    inline void parallel_apply_permutation(const void* const* inputs, const uint32_t* widths, uint32_t k,
+        const uint32_t* perm, uint32_t size, void* const* outputs)
+    {
+        internal::apply_permutation(inputs, widths, k, perm, size, outputs, thread_num);
+    }
+
+}
@@ -0,0 +1,231 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file radix.h
+ * Definition of the LSD radix sort engine for 32/64-bit integer keys and of
+ * the selector that picks it over the sorter/merger path for large int
+ * inputs.
+ *
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+
+#include "aspas.h"
+#include "tools.h"
+
+namespace aspas
+{
+
+    /// sort engine used by sort() for int keys
+    enum class sort_engine : std::int8_t
+    {
+        AUTO,   ///< radix for large inputs, scaled by the sampled key range
+        MERGE,  ///< always the SIMD sorter and merger
+        RADIX   ///< always the radix engine
+    };
+
+    /// engine selection of sort(); AUTO unless set by the caller
+    sort_engine sort_engine_mode = sort_engine::AUTO;
+
+    namespace internal
+    {
+
+        /// smallest int input handed to the radix engine when all four digits vary
+        uint32_t radix_min_size = 1 << 16;
+
+        /// keys sampled by the selector to estimate the key range
+        const uint32_t radix_samples = 256;
+
+        /**
+         * These methods map a key to an unsigned integer of the same width
+         * whose order is the order of the keys.
+         *
+         */
+        inline uint32_t radix_key(int x) { return (uint32_t)x ^ 0x80000000u; }
+        inline uint32_t radix_key(uint32_t x) { return x; }
+        inline uint64_t radix_key(int64_t x) { return (uint64_t)x ^ 0x8000000000000000ull; }
+        inline uint64_t radix_key(uint64_t x) { return x; }
+
+        /**
+         * This method scatters src into dst by one 8-bit digit.
+         *
+         * @param src the input
+         * @param dst the saving target
+         * @param size the number of elements
+         * @param shift bit offset of the digit
+         * @param offset start of each bucket in dst
+         *
+         */
+        template <class T>
+        void radix_scatter(const T* src, T* dst, uint32_t size, uint32_t shift, uint32_t* offset)
+        {
+            for (uint32_t i = 0; i < size; i++)
+                dst[offset[(uint32_t)(radix_key(src[i]) >> shift) & 255]++] = src[i];
+        }
+
+        /**
+         * This method sorts the input by least-significant-digit radix sort
+         * with 8-bit digits. All digit histograms come from one scalar read
+         * pass; digits that are equal for every key are skipped, so a narrow
+         * key range costs fewer passes. The digits are those of radix_key(),
+         * so a record with a key overload sorts by its key alone.
+         *
+         * @param array the pointer to the first element of the input array
+         * @param size the size of the input array
+         *
+         */
+        template <class T>
+        void radix_sort(T* array, uint32_t size)
+        {
+            const uint32_t digits = sizeof(radix_key(*array));
+            uint32_t (*count)[256] = new uint32_t[digits][256]();
+
+            for (uint32_t i = 0; i < size; i++)
+            {
+                auto k = radix_key(array[i]);
+                for (uint32_t d = 0; d < digits; d++)
+                    count[d][(uint32_t)(k >> (8 * d)) & 255]++;
+            }
+
+            T* buf = (T*)_mm_malloc(sizeof(T) * size, 64);
+            T* src = array;
+            T* dst = buf;
+            for (uint32_t d = 0; d < digits && size > 0; d++)
+            {
+                if (count[d][(uint32_t)(radix_key(array[0]) >> (8 * d)) & 255] == size)
+                    continue;
+
+                uint32_t offset[256];
+                uint32_t sum = 0;
+                for (uint32_t b = 0; b < 256; b++)
+                {
+                    offset[b] = sum;
+                    sum += count[d][b];
+                }
+                radix_scatter(src, dst, size, 8 * d, offset);
+                std::swap(src, dst);
+            }
+            if (src != array)
+                std::copy(src, src + size, array);
+
+            _mm_free(buf);
+            delete[] count;
+        }
+
+        /**
+         * This method returns how many 8-bit digits vary over a sample of the
+         * keys, i.e. the radix passes the input is expected to need.
+         *
+         */
+        inline uint32_t radix_sampled_passes(const int* array, uint32_t size)
+        {
+            uint32_t step = (std::max)(size / radix_samples, (uint32_t)1);
+            int lo = array[0];
+            int hi = array[0];
+            for (uint32_t i = 0; i < size; i += step)
+            {
+                lo = (std::min)(lo, array[i]);
+                hi = (std::max)(hi, array[i]);
+            }
+
+            // digits above the highest bit where min and max differ are shared
+            uint32_t diff = radix_key(lo) ^ radix_key(hi);
+            uint32_t passes = 0;
+            while (diff != 0)
+            {
+                passes++;
+                diff >>= 8;
+            }
+            return (std::max)(passes, (uint32_t)1);
+        }
+
+        /**
+         * Integer version: <br>
+         * This method sorts the input with the radix engine if sort_engine_mode
+         * asks for it, or in AUTO mode if the input is large enough for the
+         * number of digits its sampled key range spans.
+         *
+         * @param array the pointer to the first element of the input array
+         * @param size the size of the input array
+         * @return true if the input was sorted here
+         *
+         */
+        inline bool try_radix_sort(int* array, uint32_t size)
+        {
+            if (sort_engine_mode == sort_engine::MERGE || size == 0)
+                return false;
+            // the scatter needs a second copy of the input
+            if (scratch_budget != 0 && (uint64_t)size * sizeof(int) > scratch_budget)
+                return false;
+            if (sort_engine_mode == sort_engine::AUTO &&
+                (uint64_t)size * 4 < (uint64_t)radix_min_size * radix_sampled_passes(array, size))
+                return false;
+
+            radix_sort(array, size);
+            return true;
+        }
+
+        /**
+         * Floating point keys always take the sorter/merger path.
+         *
+         */
+        template <class T>
+        bool try_radix_sort(T*, uint32_t)
+        {
+            return false;
+        }
+
+        /**
+         * This method sorts the input with the engine picked for it: the radix
+         * engine if try_radix_sort() takes it, the sorter and merger otherwise.
+         *
+         * @param array the pointer to the first element of the input array
+         * @param size the size of the input array
+         *
+         */
+        template <class T>
+        void sort_direct(T* array, uint32_t size)
+        {
+            if (try_radix_sort(array, size))
+                return;
+            sorter(array, size);
+            merger(array, size);
+        }
+
+    }
+
+    /**
+     * This method sorts the given input array with the LSD radix engine.
+     * Currently the input array can be of the type of int, uint32_t, int64_t,
+     * and uint64_t.
+     *
+     * @param array the pointer to the first element of the input array
+     * @param size the size of the input array
+     * @return the sorted elements are stored in the pointer of array
+     *
+     */
+     //! This method sorts the given integer array by radix sort.
+    template <class T>
+    void radix_sort(T* array, uint32_t size)
+    {
+        internal::radix_sort(array, size);
+    }
+
+}
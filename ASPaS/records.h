@@ -0,0 +1,252 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file records.h
+ * Definition of sorting fixed-size records by a key embedded at a fixed
+ * offset. The keys are read once into (key, index) pairs, the pairs are
+ * sorted, and the records are gathered into the output in the sorted order
+ * of the indices: three passes over the keys, one over the records.
+ *
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "aspas.h"
+
+namespace aspas
+{
+
+    /// type of the key embedded in the records passed to sort_records()
+    enum class key_type : std::int8_t
+    {
+        INT32,
+        UINT32,
+        FLOAT,      ///< IEEE 754 total order, as by sort_stable()
+        INT64,
+        UINT64,
+        DOUBLE      ///< IEEE 754 total order
+    };
+
+    namespace internal
+    {
+
+        /// records copied per block of the gather; the next block is prefetched meanwhile
+        const uint32_t gather_block = 256;
+
+        /**
+         * A 64-bit key with the index of its record. radix_key() gives the
+         * key alone, so radix_sort() takes 8 digits over it.
+         */
+        struct record_pair
+        {
+            uint64_t key;
+            uint64_t index;
+        };
+
+        inline uint64_t radix_key(const record_pair& p) { return p.key; }
+
+        /**
+         * This method maps the 64-bit key at p to an unsigned integer whose
+         * order is the order of the keys.
+         *
+         */
+        inline uint64_t record_key64(const char* p, key_type type)
+        {
+            uint64_t b;
+            memcpy(&b, p, sizeof(b));
+            switch (type)
+            {
+            case key_type::INT64:
+                return b ^ 0x8000000000000000ull;
+            case key_type::DOUBLE:
+                return b ^ ((uint64_t)((int64_t)b >> 63) | 0x8000000000000000ull);
+            default:
+                return b;
+            }
+        }
+
+        /**
+         * This method maps the 32-bit key at p with stable_key().
+         *
+         */
+        inline uint32_t record_key32(const char* p, key_type type)
+        {
+            uint32_t b;
+            memcpy(&b, p, sizeof(b));
+            switch (type)
+            {
+            case key_type::INT32:
+                return stable_key((int)b);
+            case key_type::FLOAT:
+                float f;
+                memcpy(&f, &b, sizeof(f));
+                return stable_key(f);
+            default:
+                return b;
+            }
+        }
+
+        /**
+         * This method sorts the record indices by key and writes them to
+         * index. 32-bit keys are folded with their index into combined keys
+         * (stable.h) for the double kernels; 64-bit keys, and 32-bit ones
+         * past stable_max records, go through the radix engine. Ties keep
+         * their record order either way.
+         *
+         */
+        inline void sort_record_index(const char* recs, uint32_t n, size_t rec_size, size_t key_offset, key_type type, uint32_t* index)
+        {
+            const char* key = recs + key_offset;
+            if (type == key_type::INT64 || type == key_type::UINT64 || type == key_type::DOUBLE)
+            {
+                record_pair* pairs = (record_pair*)_mm_malloc(sizeof(record_pair) * n, 64);
+                for (uint32_t i = 0; i < n; i++)
+                {
+                    pairs[i].key = record_key64(key + i * rec_size, type);
+                    pairs[i].index = i;
+                }
+                radix_sort(pairs, n);
+                for (uint32_t i = 0; i < n; i++)
+                    index[i] = (uint32_t)pairs[i].index;
+                _mm_free(pairs);
+                return;
+            }
+
+            uint64_t* combined = (uint64_t*)_mm_malloc(sizeof(uint64_t) * n, 64);
+            uint32_t shift = n > stable_max ? 32 : stable_index_bits;
+            for (uint32_t i = 0; i < n; i++)
+                combined[i] = ((uint64_t)record_key32(key + i * rec_size, type) << shift) | i;
+            if (n > stable_max)
+                radix_sort(combined, n);
+            else
+                sort((double*)combined, n);
+
+            const uint64_t mask = (1ull << shift) - 1;
+            for (uint32_t i = 0; i < n; i++)
+                index[i] = (uint32_t)(combined[i] & mask);
+            _mm_free(combined);
+        }
+
+        /**
+         * This method prefetches the sources of out[begin..end), the first
+         * and the last cache line of each record.
+         *
+         */
+        inline void prefetch_records(const char* in, const uint32_t* index, uint32_t begin, uint32_t end, size_t rec_size)
+        {
+            for (uint32_t i = begin; i < end; i++)
+            {
+                const char* p = in + index[i] * rec_size;
+                _mm_prefetch(p, _MM_HINT_T0);
+                _mm_prefetch(p + rec_size - 1, _MM_HINT_T0);
+            }
+        }
+
+        /**
+         * This method gathers out[i] = in[index[i]] for records of S bytes,
+         * block by block, each block prefetched while the one before it is
+         * copied. S = 0 takes the record size from rec_size.
+         *
+         */
+        template <size_t S>
+        void gather_records(const char* in, char* out, const uint32_t* index, uint32_t n, size_t rec_size)
+        {
+            const size_t size = S != 0 ? S : rec_size;
+            prefetch_records(in, index, 0, (std::min)(gather_block, n), size);
+            for (uint32_t b = 0; b < n; b += gather_block)
+            {
+                uint32_t end = (std::min)(b + gather_block, n);
+                prefetch_records(in, index, end, (std::min)(end + gather_block, n), size);
+                for (uint32_t i = b; i < end; i++)
+                    memcpy(out + i * size, in + index[i] * size, size);
+            }
+        }
+
+        /**
+         * This method applies the permutation index to the records, with a
+         * constant-size copy for the common record sizes.
+         *
+         */
+        inline void gather_records(const char* in, char* out, const uint32_t* index, uint32_t n, size_t rec_size)
+        {
+            switch (rec_size)
+            {
+            case 8:  gather_records<8>(in, out, index, n, rec_size); break;
+            case 16: gather_records<16>(in, out, index, n, rec_size); break;
+            case 24: gather_records<24>(in, out, index, n, rec_size); break;
+            case 32: gather_records<32>(in, out, index, n, rec_size); break;
+            case 48: gather_records<48>(in, out, index, n, rec_size); break;
+            case 64: gather_records<64>(in, out, index, n, rec_size); break;
+            default: gather_records<0>(in, out, index, n, rec_size);
+            }
+        }
+
+    }
+
+    /**
+     * This method sorts n records of rec_size bytes by the key of the given type at
+     * key_offset within each record, into out. Records with equal keys keep their order.
+     * The key is read unaligned; n must be below 2^32.
+     *
+     * @param recs the pointer to the first record
+     * @param n the number of records
+     * @param rec_size the size of one record in bytes
+     * @param key_offset the byte offset of the key within a record
+     * @param type the type of the key
+     * @param out the saving target of the sorted records; must not overlap recs
+     *
+     */
+     //! This method sorts the given records by an embedded key into out.
+    inline void sort_records(const void* recs, size_t n, size_t rec_size, size_t key_offset, key_type type, void* out)
+    {
+        if (n == 0)
+            return;
+        uint32_t* index = (uint32_t*)_mm_malloc(sizeof(uint32_t) * n, 64);
+        internal::sort_record_index((const char*)recs, (uint32_t)n, rec_size, key_offset, type, index);
+        internal::gather_records((const char*)recs, (char*)out, index, (uint32_t)n, rec_size);
+        _mm_free(index);
+    }
+
+    /**
+     * This method sorts n records of rec_size bytes in place by the key of the given type
+     * at key_offset within each record. Records with equal keys keep their order. The
+     * records are gathered into a scratch buffer and copied back.
+     *
+     * @param recs the pointer to the first record
+     * @param n the number of records
+     * @param rec_size the size of one record in bytes
+     * @param key_offset the byte offset of the key within a record
+     * @param type the type of the key
+     * @return the sorted records are stored in the pointer of recs
+     *
+     */
+     //! This method sorts the given records by an embedded key.
+    inline void sort_records(void* recs, size_t n, size_t rec_size, size_t key_offset, key_type type)
+    {
+        if (n < 2)
+            return;
+        char* out = (char*)_mm_malloc(n * rec_size, 64);
+        sort_records(recs, n, rec_size, key_offset, type, out);
+        memcpy(recs, out, n * rec_size);
+        _mm_free(out);
+    }
+
+}
@@ -0,0 +1,418 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file select.h
+ * Definition of the selection routines: top_k() keeps a sorted buffer of
+ * the k smallest keys seen so far and filters the input against its largest
+ * key with vector compares; partial_sort() builds on it. select() and
+ * quantiles() are quickselects on the vectorized partitioning of inplace.h.
+ *
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+
+#include "aspas.h"
+#include "tools.h"
+
+namespace aspas
+{
+
+    namespace internal
+    {
+
+        /**
+         * This method appends the lanes of the vector at src that are below
+         * threshold to batch + count. The store is a full vector wide.
+         *
+         */
+        template <class T>
+        __forceinline void filter_vector(const T* src, T threshold, T* batch, uint32_t& count)
+        {
+            const uint32_t lanes = 32 / sizeof(T);
+            uint32_t mask = partition_mask(src, threshold, false);
+            if (mask == (1u << lanes) - 1)
+                return;
+
+            __m256i perm = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)partition_lut<T>(mask)));
+            __m256i v = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)src), perm);
+            _mm256_storeu_si256((__m256i*)(batch + count), v);
+            count += lanes - util::popcnt(mask);
+        }
+
+        /**
+         * This method sorts the batch of accepted keys and merges its
+         * smallest part into the sorted buffer best, which keeps k keys.
+         *
+         * @param best the sorted buffer, swapped with spare
+         * @param spare room for 2k keys
+         * @param k the size of best
+         * @param batch the accepted keys
+         * @param count the size of batch
+         * @param scratch room for count keys
+         *
+         */
+        template <class T>
+        void flush_batch(T*& best, T*& spare, uint32_t k, T* batch, uint32_t count, T* scratch)
+        {
+            sort_small(batch, count, scratch);
+            merge(best, k, batch, (std::min)(count, k), spare);
+            std::swap(best, spare);
+        }
+
+        /**
+         * This method swaps the keys of data[from..n) below pivot (or, with
+         * strict set, not above it) to the front, starting at position from,
+         * until limit keys are in front. Vectors without such keys are passed
+         * over after one compare, so when few keys qualify the input is only
+         * read.
+         *
+         * @return the new number of keys in front
+         *
+         */
+        template <class T>
+        uint64_t gather_front(T* data, uint64_t n, uint64_t from, uint64_t limit, T pivot, bool strict)
+        {
+            const uint32_t lanes = 32 / sizeof(T);
+            uint64_t w = from;
+            uint64_t i;
+            for (i = from; i + lanes <= n && w < limit; i += lanes)
+            {
+                // the swaps only touch positions already passed
+                uint32_t mask = ~partition_mask(data + i, pivot, strict) & ((1u << lanes) - 1);
+                while (mask != 0 && w < limit)
+                {
+                    std::swap(data[w++], data[i + util::ctz(mask)]);
+                    mask &= mask - 1;
+                }
+            }
+            for (/* cont'd */; i < n && w < limit; i++)
+            {
+                if (strict ? !(data[i] > pivot) : data[i] < pivot)
+                    std::swap(data[w++], data[i]);
+            }
+            return w;
+        }
+
+        /**
+         * This method writes the k smallest keys of data[0..n) to out in
+         * ascending order, 0 < k < n. The first k keys seed a sorted buffer;
+         * the rest is filtered a vector at a time against the largest key of
+         * the buffer, and the keys that pass are collected in a batch that is
+         * sorted and merged into the buffer when full. The threshold only
+         * drops, so on most inputs almost every vector is rejected by one
+         * compare.
+         *
+         */
+        template <class T>
+        void top_k(const T* data, uint64_t n, uint32_t k, T* out)
+        {
+            const uint32_t lanes = 32 / sizeof(T);
+            uint32_t cap = (std::max)(k, inplace_small);
+
+            T* best = (T*)_mm_malloc(sizeof(T) * 2 * k, 64);
+            T* spare = (T*)_mm_malloc(sizeof(T) * 2 * k, 64);
+            T* batch = (T*)_mm_malloc(sizeof(T) * (cap + lanes), 64);
+            T* scratch = (T*)_mm_malloc(sizeof(T) * (cap + lanes), 64);
+
+            std::copy(data, data + k, best);
+            sort_small(best, k, scratch);
+
+            uint32_t count = 0;
+            uint64_t i;
+            for (i = k; i + lanes <= n; i += lanes)
+            {
+                filter_vector(data + i, best[k - 1], batch, count);
+                if (count >= cap)
+                {
+                    flush_batch(best, spare, k, batch, count, scratch);
+                    count = 0;
+                }
+            }
+            for (/* cont'd */; i < n; i++)
+            {
+                if (data[i] < best[k - 1])
+                    batch[count++] = data[i];
+            }
+            if (count > 0)
+                flush_batch(best, spare, k, batch, count, scratch);
+
+            std::copy(best, best + k, out);
+            _mm_free(best);
+            _mm_free(spare);
+            _mm_free(batch);
+            _mm_free(scratch);
+        }
+
+
+        /**
+         * This method returns the rank of quantile q of n keys, floor(q * (n - 1)),
+         * with q clamped to [0, 1].
+         *
+         */
+        inline uint64_t quantile_rank(double q, uint64_t n)
+        {
+            if (!(q > 0))
+                return 0;
+            if (q >= 1)
+                return n - 1;
+            return (std::min)((uint64_t)(q * (double)(n - 1)), n - 1);
+        }
+
+        /**
+         * This method places the keys of the given ranks of a[0..n) where a
+         * sort would put them, with no larger key before and no smaller key
+         * after each of them. Each split sends the ranks on either side to
+         * its part, so parts holding no rank are dropped and m ranks cost
+         * about log(m) full partition passes; parts of at most inplace_small
+         * keys are sorted, and after depth bad splits a part is heap sorted.
+         *
+         * @param a the partition
+         * @param n its size
+         * @param ranks the ranks to place, ascending, relative to a
+         * @param m the number of ranks
+         * @param depth the remaining depth
+         * @param scratch room for inplace_small keys
+         *
+         */
+        template <class T>
+        void select_inplace(T* a, uint64_t n, uint64_t* ranks, uint64_t m, uint32_t depth, T* scratch)
+        {
+            while (m > 0)
+            {
+                if (n <= inplace_small)
+                {
+                    sort_small(a, (uint32_t)n, scratch);
+                    return;
+                }
+                if (depth == 0)
+                {
+                    std::make_heap(a, a + n);
+                    std::sort_heap(a, a + n);
+                    return;
+                }
+                depth--;
+
+                T* start = a;
+                uint64_t mid = split_inplace(a, n);
+                uint64_t done = (uint64_t)(a - start);
+                if (done != 0)
+                {
+                    // the keys equal to the minimum were split off in place
+                    uint64_t skip = std::lower_bound(ranks, ranks + m, done) - ranks;
+                    ranks += skip;
+                    m -= skip;
+                    for (uint64_t i = 0; i < m; i++)
+                        ranks[i] -= done;
+                    continue;
+                }
+
+                uint64_t left = std::lower_bound(ranks, ranks + m, mid) - ranks;
+                for (uint64_t i = left; i < m; i++)
+                    ranks[i] -= mid;
+                if (left < m - left)
+                {
+                    select_inplace(a, mid, ranks, left, depth, scratch);
+                    a += mid;
+                    n -= mid;
+                    ranks += left;
+                    m -= left;
+                }
+                else
+                {
+                    select_inplace(a + mid, n - mid, ranks + left, m - left, depth, scratch);
+                    n = mid;
+                    m = left;
+                }
+            }
+        }
+
+        /**
+         * This method returns the ranks of the m quantiles qs over n keys in
+         * ascending order, and in order the position of each in qs.
+         *
+         */
+        inline void quantile_ranks(const double* qs, uint64_t m, uint64_t n, uint64_t* ranks, uint64_t* order)
+        {
+            for (uint64_t i = 0; i < m; i++)
+                order[i] = i;
+            std::sort(order, order + m, [&](uint64_t x, uint64_t y) { return qs[x] < qs[y]; });
+            for (uint64_t i = 0; i < m; i++)
+                ranks[i] = quantile_rank(qs[order[i]], n);
+        }
+    }
+
+    /**
+     * This method writes the k smallest elements of the given input array to out in ascending
+     * order; the input is not modified. Currently the input array can be of the type of int,
+     * float, and double.
+     *
+     * @param data the pointer to the first element of the input array
+     * @param n the size of the input array
+     * @param k the number of elements to select
+     * @param out the saving target of min(k, n) elements
+     *
+     */
+     //! This method copies the k smallest elements of the input out in sorted order.
+    template <class T>
+    void top_k(const T* data, size_t n, size_t k, T* out)
+    {
+        if (k == 0)
+            return;
+        if (k >= n)
+        {
+            std::copy(data, data + n, out);
+            sort_inplace(out, n);
+            return;
+        }
+        internal::top_k(data, (uint64_t)n, (uint32_t)k, out);
+    }
+
+    /**
+     * This method rearranges the given input array so that its first k elements are the k
+     * smallest in ascending order, like std::partial_sort; the order of the remaining
+     * elements is unspecified. Currently the input array can be of the type of int, float,
+     * and double.
+     *
+     * @param data the pointer to the first element of the input array
+     * @param n the size of the input array
+     * @param k the number of elements to sort into place
+     *
+     */
+     //! This method sorts the k smallest elements of the input into its front.
+    template <class T>
+    void partial_sort(T* data, size_t n, size_t k)
+    {
+        if (k == 0)
+            return;
+        if (n <= internal::inplace_small || k >= n / 2)
+        {
+            sort_inplace(data, n);
+            return;
+        }
+
+        T* best = (T*)_mm_malloc(sizeof(T) * k, 64);
+        internal::top_k(data, (uint64_t)n, (uint32_t)k, best);
+
+        // move the keys below the k-th one, then enough of its ties, to the front
+        T kth = best[k - 1];
+        uint64_t below = internal::gather_front(data, (uint64_t)n, 0, k, kth, false);
+        internal::gather_front(data, (uint64_t)n, below, k, kth, true);
+        std::copy(best, best + k, data);
+        _mm_free(best);
+    }
+
+    /**
+     * This method rearranges the given input array like std::nth_element: the element at
+     * position k is the one a sort would put there, no element before it is larger and no
+     * element after it is smaller. Currently the input array can be of the type of int,
+     * float, and double.
+     *
+     * @param data the pointer to the first element of the input array
+     * @param n the size of the input array
+     * @param k the position to select, k < n
+     * @return the selected element
+     *
+     */
+     //! This method moves the kth smallest element of the input into position k.
+    template <class T>
+    T select(T* data, size_t n, size_t k)
+    {
+        uint64_t rank = k;
+        T* scratch = (T*)_mm_malloc(sizeof(T) * internal::inplace_small, 64);
+        internal::select_inplace(data, (uint64_t)n, &rank, 1, internal::inplace_depth(n), scratch);
+        _mm_free(scratch);
+        return data[k];
+    }
+
+    /**
+     * This method computes m quantiles of the given input array in one multi-select pass,
+     * which reorders the input. The quantile q is the element of rank floor(q * (n - 1)),
+     * with q clamped to [0, 1]. Currently the input array can be of the type of int, float,
+     * and double.
+     *
+     * @param data the pointer to the first element of the input array
+     * @param n the size of the input array, at least 1
+     * @param qs the quantiles, in any order
+     * @param m the number of quantiles
+     * @param out the saving target of the m elements, in the order of qs
+     *
+     */
+     //! This method computes many quantiles of the input at once.
+    template <class T>
+    void quantiles(T* data, size_t n, const double* qs, size_t m, T* out)
+    {
+        uint64_t* ranks = new uint64_t[m];
+        uint64_t* order = new uint64_t[m];
+        internal::quantile_ranks(qs, m, n, ranks, order);
+
+        // ranks is consumed by the selection
+        uint64_t* placed = new uint64_t[m];
+        std::copy(ranks, ranks + m, placed);
+        T* scratch = (T*)_mm_malloc(sizeof(T) * internal::inplace_small, 64);
+        internal::select_inplace(data, (uint64_t)n, placed, m, internal::inplace_depth(n), scratch);
+        _mm_free(scratch);
+
+        for (size_t i = 0; i < m; i++)
+            out[order[i]] = data[ranks[i]];
+        delete[] ranks;
+        delete[] order;
+        delete[] placed;
+    }
+
+    /**
+     * This method computes m quantiles over the union of k sorted runs, e.g. the blocks of a
+     * partially merged array, without moving any element. Each quantile is found from the
+     * co-ranks of its rank over the runs (find_kth_multi) in O(k log n) steps.
+     *
+     * @param runs the sorted runs
+     * @param lens the size of each run
+     * @param k the number of runs
+     * @param qs the quantiles, in any order
+     * @param m the number of quantiles
+     * @param out the saving target of the m elements, in the order of qs
+     *
+     */
+     //! This method computes many quantiles over several sorted runs.
+    template <class T>
+    void quantiles(const T* const* runs, const size_t* lens, size_t k, const double* qs, size_t m, T* out)
+    {
+        uint64_t n = 0;
+        for (size_t i = 0; i < k; i++)
+            n += lens[i];
+        size_t* split = new size_t[k];
+
+        for (size_t j = 0; j < m; j++)
+        {
+            // the key of rank r is the largest of the first r + 1
+            find_kth_multi(runs, lens, k, internal::quantile_rank(qs[j], n) + 1, split);
+            bool found = false;
+            for (size_t i = 0; i < k; i++)
+            {
+                if (split[i] != 0 && (!found || out[j] < runs[i][split[i] - 1]))
+                {
+                    out[j] = runs[i][split[i] - 1];
+                    found = true;
+                }
+            }
+        }
+        delete[] split;
+    }
+
+}
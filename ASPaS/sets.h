@@ -0,0 +1,472 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file sets.h
+ * Definition of the set operations on sorted arrays of distinct keys. A
+ * vector of one set is compared with a vector of the other in every
+ * rotation, and the keys of the first found (or not found) in the second
+ * are compress-stored; the vectors advance like the inputs of a merge.
+ * Union and symmetric difference are a branchless merge. If one set is far
+ * smaller, each of its keys is instead searched in the other by galloping.
+ *
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "aspas.h"
+
+namespace aspas
+{
+
+    namespace internal
+    {
+
+        /// a set this many times smaller than the other is galloped into it
+        const uint32_t set_gallop_ratio = 64;
+
+        /// set_gallop_ratio for a larger set out of L2
+        const uint32_t set_gallop_ratio_memory = 4096;
+
+        /**
+         * The parts of a union of A and B kept by a set operation: the keys
+         * only in A, only in B, and in both.
+         */
+        struct set_parts
+        {
+            bool only_a;
+            bool only_b;
+            bool both;
+
+            set_parts(bool a, bool b, bool ab) : only_a(a), only_b(b), both(ab) {}
+        };
+
+        /**
+         * Integer version: <br>
+         * This method returns the mask of the lanes of a[0..7] equal to any
+         * lane of b[0..7]: b is compared in its four rotations within each
+         * 128-bit half, then with its halves swapped.
+         *
+         */
+        inline uint32_t match_mask(const int* a, const int* b)
+        {
+            __m256i va = _mm256_loadu_si256((const __m256i*)a);
+            __m256i vb = _mm256_loadu_si256((const __m256i*)b);
+            __m256i vs = _mm256_permute2x128_si256(vb, vb, 1);
+            __m256i m = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi32(va, vb),
+                    _mm256_cmpeq_epi32(va, _mm256_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+                _mm256_or_si256(_mm256_cmpeq_epi32(va, _mm256_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+                    _mm256_cmpeq_epi32(va, _mm256_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+            m = _mm256_or_si256(m, _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi32(va, vs),
+                    _mm256_cmpeq_epi32(va, _mm256_shuffle_epi32(vs, _MM_SHUFFLE(0, 3, 2, 1)))),
+                _mm256_or_si256(_mm256_cmpeq_epi32(va, _mm256_shuffle_epi32(vs, _MM_SHUFFLE(1, 0, 3, 2))),
+                    _mm256_cmpeq_epi32(va, _mm256_shuffle_epi32(vs, _MM_SHUFFLE(2, 1, 0, 3))))));
+            return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(m));
+        }
+
+        /**
+         * Unsigned integer version: <br>
+         * Equality does not depend on the sign, so this is the integer one.
+         *
+         */
+        inline uint32_t match_mask(const uint32_t* a, const uint32_t* b)
+        {
+            return match_mask((const int*)a, (const int*)b);
+        }
+
+        /**
+         * 64-bit integer version: <br>
+         * This method returns the mask of the lanes of a[0..3] equal to any
+         * lane of b[0..3].
+         *
+         */
+        inline uint32_t match_mask(const int64_t* a, const int64_t* b)
+        {
+            __m256i va = _mm256_loadu_si256((const __m256i*)a);
+            __m256i vb = _mm256_loadu_si256((const __m256i*)b);
+            __m256i vs = _mm256_permute4x64_epi64(vb, _MM_SHUFFLE(1, 0, 3, 2));
+            __m256i m = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi64(va, vb),
+                    _mm256_cmpeq_epi64(va, _mm256_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2)))),
+                _mm256_or_si256(_mm256_cmpeq_epi64(va, vs),
+                    _mm256_cmpeq_epi64(va, _mm256_shuffle_epi32(vs, _MM_SHUFFLE(1, 0, 3, 2)))));
+            return (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(m));
+        }
+
+        /**
+         * Integer version: <br>
+         * This method returns the number of lanes of p[0..7] below key.
+         *
+         */
+        inline uint32_t count_below(const int* p, int key)
+        {
+            __m256i m = _mm256_cmpgt_epi32(_mm256_set1_epi32(key), _mm256_loadu_si256((const __m256i*)p));
+            return util::popcnt((uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(m)));
+        }
+
+        /**
+         * Unsigned integer version: <br>
+         * Both sides are biased onto the signed compare.
+         *
+         */
+        inline uint32_t count_below(const uint32_t* p, uint32_t key)
+        {
+            const __m256i bias = _mm256_set1_epi32((int)0x80000000);
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)p), bias);
+            __m256i m = _mm256_cmpgt_epi32(_mm256_xor_si256(_mm256_set1_epi32((int)key), bias), v);
+            return util::popcnt((uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(m)));
+        }
+
+        /**
+         * 64-bit integer version: <br>
+         * This method returns the number of lanes of p[0..3] below key.
+         *
+         */
+        inline uint32_t count_below(const int64_t* p, int64_t key)
+        {
+            __m256i m = _mm256_cmpgt_epi64(_mm256_set1_epi64x(key), _mm256_loadu_si256((const __m256i*)p));
+            return util::popcnt((uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(m)));
+        }
+
+        /**
+         * This method returns the first position p >= lo of large[0..n)
+         * with large[p] >= key: it gallops from lo in doubling steps, halves
+         * the step it overshot down to a vector, and counts the keys below
+         * key in that vector.
+         *
+         */
+        template <typename T>
+        uint32_t gallop(const T* large, uint32_t n, uint32_t lo, T key)
+        {
+            const uint32_t lanes = 32 / sizeof(T);
+            if (lo >= n || !(large[lo] < key))
+                return lo;
+
+            // large[base] < key, and large[top] >= key unless top == n
+            uint32_t base = lo, step = 1;
+            while (base + step < n && large[base + step] < key)
+            {
+                base += step;
+                step <<= 1;
+            }
+            uint32_t top = (std::min)(base + step, n);
+            while (top - base > lanes)
+            {
+                uint32_t mid = base + (top - base) / 2;
+                if (large[mid] < key)
+                    base = mid;
+                else
+                    top = mid;
+            }
+            if (base + 1 + lanes <= n)
+                return base + 1 + count_below(large + base + 1, key);
+            uint32_t p = base + 1;
+            while (p < top && large[p] < key)
+                p++;
+            return p;
+        }
+
+        /**
+         * This method merges the set small into the set large, keeping the
+         * given parts: every key of small is galloped to in large, and the
+         * keys of large before it are copied as a block.
+         *
+         * @return the number of keys stored
+         *
+         */
+        template <typename T>
+        uint32_t gallop_merge(const T* small, uint32_t ns, const T* large, uint32_t nl, T* output, bool only_small, bool only_large, bool both)
+        {
+            uint32_t w = 0, lo = 0;
+            for (uint32_t s = 0; s < ns; s++)
+            {
+                T key = small[s];
+                uint32_t p = gallop(large, nl, lo, key);
+                if (only_large)
+                {
+                    memcpy(output + w, large + lo, sizeof(T) * (p - lo));
+                    w += p - lo;
+                }
+                bool found = p < nl && large[p] == key;
+                if (found ? both : only_small)
+                    output[w++] = key;
+                lo = found ? p + 1 : p;
+            }
+            if (only_large)
+            {
+                memcpy(output + w, large + lo, sizeof(T) * (nl - lo));
+                w += nl - lo;
+            }
+            return w;
+        }
+
+        /**
+         * This method compress-stores the lanes of src[0..lanes) set in keep
+         * to dst, a whole vector if room allows and through a buffer
+         * otherwise.
+         *
+         * @return the number of keys stored
+         *
+         */
+        template <typename T>
+        uint32_t store_lanes(const T* src, uint32_t keep, T* dst, uint32_t room)
+        {
+            const uint32_t lanes = 32 / sizeof(T);
+            if (keep == 0)
+                return 0;
+            // lanes with a clear mask bit go to the low end
+            __m256i perm = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)partition_lut<T>(~keep & ((1u << lanes) - 1))));
+            __m256i v = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)src), perm);
+            uint32_t n = util::popcnt(keep);
+            if (room >= lanes)
+            {
+                _mm256_storeu_si256((__m256i*)dst, v);
+                return n;
+            }
+            T buffer[32 / sizeof(T)];
+            _mm256_storeu_si256((__m256i*)buffer, v);
+            memcpy(dst, buffer, sizeof(T) * n);
+            return n;
+        }
+
+        /**
+         * This method stores the keys of the set A found in the set B, or
+         * with found clear the keys not found, to output. A vector of A is
+         * compared with the vectors of B whose ranges overlap its own until
+         * the last key of B passes its own; the lanes matched so far stay in
+         * a mask until A advances. The keys left over are finished by a
+         * scalar merge.
+         *
+         * @param room the capacity of output
+         * @return the number of keys stored
+         *
+         */
+        template <typename T>
+        uint32_t filter_set(const T* inputA, uint32_t sizeA, const T* inputB, uint32_t sizeB, T* output, uint32_t room, bool found)
+        {
+            const uint32_t lanes = 32 / sizeof(T);
+            const uint32_t full = (1u << lanes) - 1;
+            uint32_t i = 0, j = 0, w = 0;
+            uint32_t mask = 0;
+
+            if (sizeA >= lanes && sizeB >= lanes)
+            {
+                while (true)
+                {
+                    T a = inputA[i + lanes - 1], b = inputB[j + lanes - 1];
+                    // disjoint ranges, as most are when the sizes differ, have nothing to match
+                    if (!(a < inputB[j]) && !(b < inputA[i]))
+                        mask |= match_mask(inputA + i, inputB + j);
+                    if (a <= b)
+                    {
+                        w += store_lanes(inputA + i, found ? mask : ~mask & full, output + w, room - w);
+                        mask = 0;
+                        i += lanes;
+                        if (i + lanes > sizeA)
+                            break;
+                    }
+                    if (b <= a)
+                    {
+                        j += lanes;
+                        if (j + lanes > sizeB)
+                            break;
+                    }
+                }
+            }
+
+            // the matches of the lanes left in mask lie in B before j
+            for (uint32_t p = i; p < sizeA; p++)
+            {
+                T key = inputA[p];
+                bool hit = p - i < lanes && ((mask >> (p - i)) & 1);
+                if (!hit)
+                {
+                    while (j < sizeB && inputB[j] < key)
+                        j++;
+                    hit = j < sizeB && inputB[j] == key;
+                }
+                if (hit == found)
+                    output[w++] = key;
+                if (j == sizeB && p - i >= lanes)
+                {
+                    if (!found)
+                    {
+                        memcpy(output + w, inputA + p + 1, sizeof(T) * (sizeA - p - 1));
+                        w += sizeA - p - 1;
+                    }
+                    break;
+                }
+            }
+            return w;
+        }
+
+        /**
+         * This method merges the sets A and B into output, with one copy of
+         * the keys in both if both is set and none otherwise. The merge is
+         * branchless, except that a vector of one set below the next key of
+         * the other is copied whole, which pays off as the sizes drift apart.
+         *
+         * @return the number of keys stored
+         *
+         */
+        template <typename T>
+        uint32_t merge_sets(const T* inputA, uint32_t sizeA, const T* inputB, uint32_t sizeB, T* output, bool both)
+        {
+            const uint32_t lanes = 32 / sizeof(T);
+            uint32_t i = 0, j = 0, w = 0;
+            while (i < sizeA && j < sizeB)
+            {
+                T a = inputA[i], b = inputB[j];
+                if (i + lanes <= sizeA && inputA[i + lanes - 1] < b)
+                {
+                    _mm256_storeu_si256((__m256i*)(output + w), _mm256_loadu_si256((const __m256i*)(inputA + i)));
+                    i += lanes;
+                    w += lanes;
+                    continue;
+                }
+                if (j + lanes <= sizeB && inputB[j + lanes - 1] < a)
+                {
+                    _mm256_storeu_si256((__m256i*)(output + w), _mm256_loadu_si256((const __m256i*)(inputB + j)));
+                    j += lanes;
+                    w += lanes;
+                    continue;
+                }
+                output[w] = a < b ? a : b;
+                w += both || a != b;
+                i += a <= b;
+                j += b <= a;
+            }
+            memcpy(output + w, inputA + i, sizeof(T) * (sizeA - i));
+            w += sizeA - i;
+            memcpy(output + w, inputB + j, sizeof(T) * (sizeB - j));
+            return w + sizeB - j;
+        }
+
+        /**
+         * This method stores the given parts of the sets A and B to output:
+         * by galloping if either set is far smaller than the other, by
+         * filter_set() if no keys only in B are kept, and otherwise by
+         * merge_sets(). Galloping misses the cache a few times per key once
+         * the larger set is out of L2, where it takes a wider ratio to beat
+         * streaming through the larger set.
+         *
+         * @return the number of keys stored
+         *
+         */
+        template <typename T>
+        uint32_t set_operation(const T* inputA, uint32_t sizeA, const T* inputB, uint32_t sizeB, T* output, set_parts parts)
+        {
+            uint64_t larger = (std::max)(sizeA, sizeB);
+            uint64_t ratio = larger * sizeof(T) > util::cache_size(2) ? set_gallop_ratio_memory : set_gallop_ratio;
+            if (sizeA * ratio <= sizeB)
+                return gallop_merge(inputA, sizeA, inputB, sizeB, output, parts.only_a, parts.only_b, parts.both);
+            if (sizeB * ratio <= sizeA)
+                return gallop_merge(inputB, sizeB, inputA, sizeA, output, parts.only_b, parts.only_a, parts.both);
+
+            if (!parts.only_b)
+                return filter_set(inputA, sizeA, inputB, sizeB, output, parts.only_a ? sizeA : (std::min)(sizeA, sizeB), parts.both);
+            return merge_sets(inputA, sizeA, inputB, sizeB, output, parts.both);
+        }
+
+    }
+    /**
+     * This method stores the keys found in both sorted input arrays. The inputs are sets:
+     * sorted, with no key repeated. Currently they can be of the type of int, uint32_t, and
+     * int64_t.
+     *
+     * @param inputA the first sorted array
+     * @param sizeA the size of the first array
+     * @param inputB the second sorted array
+     * @param sizeB the size of the second array
+     * @param output the saving target of the sorted intersection, room for the smaller size
+     * @return the number of keys stored
+     *
+     */
+     //! This method intersects two sorted sets.
+    template <typename T>
+    uint32_t set_intersection(const T* inputA, uint32_t sizeA, const T* inputB, uint32_t sizeB, T* output)
+    {
+        return internal::set_operation(inputA, sizeA, inputB, sizeB, output, internal::set_parts(false, false, true));
+    }
+
+    /**
+     * This method stores the keys found in either sorted input array, each once. The inputs
+     * are sets: sorted, with no key repeated. Currently they can be of the type of int,
+     * uint32_t, and int64_t.
+     *
+     * @param inputA the first sorted array
+     * @param sizeA the size of the first array
+     * @param inputB the second sorted array
+     * @param sizeB the size of the second array
+     * @param output the saving target of the sorted union, room for sizeA + sizeB keys
+     * @return the number of keys stored
+     *
+     */
+     //! This method unites two sorted sets.
+    template <typename T>
+    uint32_t set_union(const T* inputA, uint32_t sizeA, const T* inputB, uint32_t sizeB, T* output)
+    {
+        return internal::set_operation(inputA, sizeA, inputB, sizeB, output, internal::set_parts(true, true, true));
+    }
+
+    /**
+     * This method stores the keys of the first sorted input array not found in the second.
+     * The inputs are sets: sorted, with no key repeated. Currently they can be of the type
+     * of int, uint32_t, and int64_t.
+     *
+     * @param inputA the first sorted array
+     * @param sizeA the size of the first array
+     * @param inputB the second sorted array
+     * @param sizeB the size of the second array
+     * @param output the saving target of the sorted difference, room for sizeA keys
+     * @return the number of keys stored
+     *
+     */
+     //! This method subtracts a sorted set from another.
+    template <typename T>
+    uint32_t set_difference(const T* inputA, uint32_t sizeA, const T* inputB, uint32_t sizeB, T* output)
+    {
+        return internal::set_operation(inputA, sizeA, inputB, sizeB, output, internal::set_parts(true, false, false));
+    }
+
+    /**
+     * This method stores the keys found in exactly one of the sorted input arrays. The
+     * inputs are sets: sorted, with no key repeated. Currently they can be of the type of
+     * int, uint32_t, and int64_t.
+     *
+     * @param inputA the first sorted array
+     * @param sizeA the size of the first array
+     * @param inputB the second sorted array
+     * @param sizeB the size of the second array
+     * @param output the saving target of the sorted symmetric difference, room for
+     * sizeA + sizeB keys
+     * @return the number of keys stored
+     *
+     */
+     //! This method stores the keys in exactly one of two sorted sets.
+    template <typename T>
+    uint32_t set_symmetric_difference(const T* inputA, uint32_t sizeA, const T* inputB, uint32_t sizeB, T* output)
+    {
+        return internal::set_operation(inputA, sizeA, inputB, sizeB, output, internal::set_parts(true, true, false));
+    }
+
+}
@@ -24,6 +24,8 @@
 #include <cstdint>
 #include <type_traits>
 
+#include "keys.h"
+
 namespace aspas
 {
 
@@ -75,12 +77,13 @@ namespace aspas
           *
           * @param data targeting data
           * @param size data size
+          * @param tf transform applied to the keys as they are loaded
           * @return partially sorted data
           *
           */
           /*template <typename T>
           typename std::enable_if<std::is_same<T, int>::value>::type*/
-        void sorter(int*& data, uint32_t size);
+        void sorter(int*& data, uint32_t size, key_transform tf = key_transform());
 
         /**
          * Float version:
@@ -89,12 +92,13 @@ namespace aspas
          *
          * @param data targeting data
          * @param size data size
+         * @param tf transform applied to the keys as they are loaded
          * @return partially sorted data
          *
          */
         /*template <typename T>
         typename std::enable_if<std::is_same<T, float>::value>::type*/
-            void sorter(float*& data, uint32_t size);
+            void sorter(float*& data, uint32_t size, key_transform tf = key_transform());
 
         /**
          * Double version:
@@ -103,12 +107,13 @@ namespace aspas
          *
          * @param data targeting data
          * @param size data size
+         * @param tf transform applied to the keys as they are loaded
          * @return partially sorted data
          *
          */
         /*template <typename T>
         typename std::enable_if<std::is_same<T, double>::value>::type*/
-            void sorter(double*& data, uint32_t size);
+            void sorter(double*& data, uint32_t size, key_transform tf = key_transform());
 
 
     } // end namespace internal
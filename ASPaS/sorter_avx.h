@@ -371,7 +371,7 @@ namespace aspas
 
         //template <typename T>
        // typename std::enable_if<std::is_same<T, int>::value>::type
-        void    sorter(int*& orig, uint32_t size)
+        void    sorter(int*& orig, uint32_t size, key_transform tf)
         {
             uint32_t i, j;
             __m256i vec0;
@@ -393,6 +393,18 @@ namespace aspas
                 vec6 = _mm256_loadu_si256((__m256i*)(orig + i + 6 * stride));
                 vec7 = _mm256_loadu_si256((__m256i*)(orig + i + 7 * stride));
 
+                if (tf.op != key_op::NONE)
+                {
+                    vec0 = encode_vector(vec0, tf);
+                    vec1 = encode_vector(vec1, tf);
+                    vec2 = encode_vector(vec2, tf);
+                    vec3 = encode_vector(vec3, tf);
+                    vec4 = encode_vector(vec4, tf);
+                    vec5 = encode_vector(vec5, tf);
+                    vec6 = encode_vector(vec6, tf);
+                    vec7 = encode_vector(vec7, tf);
+                }
+
                 in_register_sort(vec0, vec1, vec2, vec3,
                     vec4, vec5, vec6, vec7);
 
@@ -409,6 +421,9 @@ namespace aspas
                 _mm256_storeu_si256((__m256i*)(orig + i + 7 * stride), vec7);
             }
 
+            // the scalar tail is encoded up front
+            transform_keys(orig + i, size - i, tf, false);
+
             // Batcher odd-even mergesort
             for (/*cont'd*/; i + stride - 1 < size; i += stride)
             {
@@ -445,7 +460,7 @@ namespace aspas
 
         /*template <typename T>
         typename std::enable_if<std::is_same<T, float>::value>::type*/
-        void    sorter(float*& orig, uint32_t size)
+        void    sorter(float*& orig, uint32_t size, key_transform tf)
         {
             uint32_t i, j;
             __m256 vec0;
@@ -467,6 +482,18 @@ namespace aspas
                 vec6 = _mm256_loadu_ps((orig + i + 6 * stride));
                 vec7 = _mm256_loadu_ps((orig + i + 7 * stride));
 
+                if (tf.op != key_op::NONE)
+                {
+                    vec0 = encode_vector(vec0, tf);
+                    vec1 = encode_vector(vec1, tf);
+                    vec2 = encode_vector(vec2, tf);
+                    vec3 = encode_vector(vec3, tf);
+                    vec4 = encode_vector(vec4, tf);
+                    vec5 = encode_vector(vec5, tf);
+                    vec6 = encode_vector(vec6, tf);
+                    vec7 = encode_vector(vec7, tf);
+                }
+
                 in_register_sort(vec0, vec1, vec2, vec3,
                     vec4, vec5, vec6, vec7);
 
@@ -483,6 +510,9 @@ namespace aspas
                 _mm256_storeu_ps((orig + i + 7 * stride), vec7);
             }
 
+            // the scalar tail is encoded up front
+            transform_keys(orig + i, size - i, tf, false);
+
             // Batcher odd-even mergesort
             for (/*cont'd*/; i + stride - 1 < size; i += stride)
             {
@@ -518,7 +548,7 @@ namespace aspas
         }
     /*template <typename T>
         typename std::enable_if<std::is_same<T, double>::value>::type*/
-        void    sorter(double *& orig, uint32_t size)
+        void    sorter(double*& orig, uint32_t size, key_transform tf)
         {
             uint32_t i, j;
             __m256d vec0;
@@ -532,6 +562,14 @@ namespace aspas
                 vec2 = _mm256_loadu_pd((orig + i + 2 * stride));
                 vec3 = _mm256_loadu_pd((orig + i + 3 * stride));
 
+                if (tf.op != key_op::NONE)
+                {
+                    vec0 = encode_vector(vec0, tf);
+                    vec1 = encode_vector(vec1, tf);
+                    vec2 = encode_vector(vec2, tf);
+                    vec3 = encode_vector(vec3, tf);
+                }
+
                 in_register_sort(vec0, vec1, vec2, vec3);
 
                 in_register_transpose(vec0, vec1, vec2, vec3);
@@ -542,6 +580,9 @@ namespace aspas
                 _mm256_storeu_pd((orig + i + 3 * stride), vec3);
             }
 
+            // the scalar tail is encoded up front
+            transform_keys(orig + i, size - i, tf, false);
+
             // Batcher odd-even mergesort
             for (/*cont'd*/; i + stride - 1 < size; i += stride)
             {
@@ -0,0 +1,338 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file stable.h
+ * Definition of the stable key-value sort and merge. The bitonic networks
+ * are not stable, so each 32-bit key is folded with its original position
+ * into one 64-bit combined key: the key in the high bits, the position as
+ * the tiebreaker in the low bits. Combined keys are unique, so any sort of
+ * them is stable. With the top two bits clear they are also non-negative
+ * finite doubles that order like the integers, so they run through the
+ * double sorter and merge kernels unchanged.
+ *
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+#include "aspas.h"
+
+namespace aspas
+{
+
+    namespace internal
+    {
+
+        /// bits of the combined key that hold the position
+        const uint32_t stable_index_bits = 30;
+
+        /// inputs up to this size take the double kernels, larger ones the radix engine
+        const uint64_t stable_max = 1ull << stable_index_bits;
+
+        /// fewest elements per thread for the parallel passes
+        const uint32_t stable_parallel_min = 4096;
+
+        /**
+         * These methods map a key to an unsigned integer whose order is the
+         * order of the keys, and back. Floats are mapped in IEEE total
+         * order, so -0 comes before +0.
+         *
+         */
+        inline uint32_t stable_key(int x) { return (uint32_t)x ^ 0x80000000u; }
+        inline uint32_t stable_key(uint32_t x) { return x; }
+        inline uint32_t stable_key(float x)
+        {
+            uint32_t b;
+            memcpy(&b, &x, sizeof(b));
+            return b ^ ((uint32_t)((int32_t)b >> 31) | 0x80000000u);
+        }
+
+        inline void stable_unkey(uint32_t u, int& x) { x = (int)(u ^ 0x80000000u); }
+        inline void stable_unkey(uint32_t u, uint32_t& x) { x = u; }
+        inline void stable_unkey(uint32_t u, float& x)
+        {
+            uint32_t b = (u & 0x80000000u) ? u ^ 0x80000000u : ~u;
+            memcpy(&x, &b, sizeof(b));
+        }
+
+        /**
+         * This method writes the combined keys of keys[begin..end) to
+         * combined, numbering them from base + begin.
+         *
+         */
+        template <class K>
+        void stable_pack(const K* keys, uint32_t begin, uint32_t end, uint64_t base, uint32_t shift, uint64_t* combined)
+        {
+            for (uint32_t i = begin; i < end; i++)
+                combined[i] = ((uint64_t)stable_key(keys[i]) << shift) | (base + i);
+        }
+
+        /**
+         * This method decodes the keys of combined[begin..end) into keys and
+         * fetches the value of each from its original position: below split
+         * in values_a, from split on in values_b.
+         *
+         */
+        template <class K, class V>
+        void stable_unpack(const uint64_t* combined, uint32_t begin, uint32_t end, uint32_t shift,
+            const V* values_a, uint32_t split, const V* values_b, K* keys, V* values)
+        {
+            const uint64_t mask = (1ull << shift) - 1;
+            for (uint32_t i = begin; i < end; i++)
+            {
+                uint64_t c = combined[i];
+                uint64_t pos = c & mask;
+                stable_unkey((uint32_t)(c >> shift), keys[i]);
+                values[i] = pos < split ? values_a[pos] : values_b[pos - split];
+            }
+        }
+
+        template <class K, class V>
+        struct args_stable
+        {
+            const K* keys;
+            K* keys_out;
+            const V* values_a;
+            uint32_t split;
+            const V* values_b;
+            V* values_out;
+            uint64_t* combined;
+            uint64_t base;
+            uint32_t begin;
+            uint32_t end;
+        };
+
+        template <class K, class V>
+        void thread_pack_kernel(void* arguments)
+        {
+            args_stable<K, V>* args = (args_stable<K, V>*)arguments;
+            stable_pack(args->keys, args->begin, args->end, args->base, stable_index_bits, args->combined);
+        }
+
+        template <class K, class V>
+        void thread_unpack_kernel(void* arguments)
+        {
+            args_stable<K, V>* args = (args_stable<K, V>*)arguments;
+            stable_unpack(args->combined, args->begin, args->end, stable_index_bits,
+                args->values_a, args->split, args->values_b, args->keys_out, args->values_out);
+        }
+
+        /**
+         * This method runs the pack (or unpack) kernel over [0, size) split
+         * evenly across threads threads.
+         *
+         */
+        template <class K, class V>
+        void stable_pass(args_stable<K, V> proto, uint32_t size, uint32_t threads, bool unpack)
+        {
+            threads = (std::max)((std::min)(threads, size / stable_parallel_min), (uint32_t)1);
+            std::thread* workers = new std::thread[threads];
+            args_stable<K, V>* args = new args_stable<K, V>[threads];
+
+            for (uint32_t t = 0; t < threads; t++)
+            {
+                args[t] = proto;
+                args[t].begin = (uint32_t)((uint64_t)size * t / threads);
+                args[t].end = (uint32_t)((uint64_t)size * (t + 1) / threads);
+                if (unpack)
+                    workers[t] = std::thread(thread_unpack_kernel<K, V>, &args[t]);
+                else
+                    workers[t] = std::thread(thread_pack_kernel<K, V>, &args[t]);
+            }
+            for (uint32_t t = 0; t < threads; t++)
+                workers[t].join();
+
+            delete[] workers;
+            delete[] args;
+        }
+
+        /**
+         * This method sorts keys and values stably with the given number of
+         * threads: pack, sort the combined keys, unpack.
+         *
+         */
+        template <class K, class V>
+        void sort_stable(K* keys, V* values, uint32_t size, uint32_t threads)
+        {
+            if (size < 2)
+                return;
+
+            uint64_t* combined = (uint64_t*)_mm_malloc(sizeof(uint64_t) * size, 64);
+            V* original = new V[size];
+            std::copy(values, values + size, original);
+
+            if (size > stable_max)
+            {
+                // positions need all 32 low bits; the radix engine takes full 64-bit keys
+                stable_pack(keys, 0, size, 0, 32, combined);
+                radix_sort(combined, size);
+                stable_unpack(combined, 0, size, 32, original, size, original, keys, values);
+            }
+            else
+            {
+                args_stable<K, V> proto;
+                proto.keys = keys;
+                proto.keys_out = keys;
+                proto.values_a = original;
+                proto.split = size;
+                proto.values_b = original;
+                proto.values_out = values;
+                proto.combined = combined;
+                proto.base = 0;
+
+                stable_pass(proto, size, threads, false);
+                double* lanes = (double*)combined;
+                // the merge tree of parallel_sort needs sizeable segments
+                if (threads > 1 && size / thread_num >= stable_parallel_min)
+                    parallel_sort(lanes, size);
+                else
+                    sort(lanes, size);
+                stable_pass(proto, size, threads, true);
+            }
+
+            delete[] original;
+            _mm_free(combined);
+        }
+
+        /**
+         * This method merges two key-sorted key-value arrays stably, ties
+         * taken from A first, with the given number of threads.
+         *
+         */
+        template <class K, class V>
+        void merge_stable(const K* keysA, const V* valuesA, uint32_t sizeA, const K* keysB, const V* valuesB, uint32_t sizeB,
+            K* keys, V* values, uint32_t threads)
+        {
+            // the fallback is for large inputs, whose sum may not fit 32 bits
+            uint64_t total = (uint64_t)sizeA + sizeB;
+            if (total > stable_max)
+            {
+                uint32_t ia = 0, ib = 0;
+                for (uint64_t i = 0; i < total; i++)
+                {
+                    bool take_a = ib == sizeB || (ia < sizeA && !(keysB[ib] < keysA[ia]));
+                    keys[i] = take_a ? keysA[ia] : keysB[ib];
+                    values[i] = take_a ? valuesA[ia++] : valuesB[ib++];
+                }
+                return;
+            }
+
+            uint32_t size = (uint32_t)total;
+            uint64_t* combined = (uint64_t*)_mm_malloc(sizeof(uint64_t) * (size + (uint64_t)size), 64);
+            uint64_t* merged = combined + size;
+
+            args_stable<K, V> proto;
+            proto.values_a = valuesA;
+            proto.split = sizeA;
+            proto.values_b = valuesB;
+            proto.keys_out = keys;
+            proto.values_out = values;
+
+            proto.keys = keysA;
+            proto.combined = combined;
+            proto.base = 0;
+            stable_pass(proto, sizeA, threads, false);
+            proto.keys = keysB;
+            proto.combined = combined + sizeA;
+            proto.base = sizeA;
+            stable_pass(proto, sizeB, threads, false);
+
+            double* lanes = (double*)combined;
+            if (threads > 1 && size / threads >= stable_parallel_min)
+                parallel_merge(lanes, sizeA, lanes + sizeA, sizeB, (double*)merged, threads);
+            else
+                merge(lanes, sizeA, lanes + sizeA, sizeB, (double*)merged);
+
+            proto.combined = merged;
+            stable_pass(proto, size, threads, true);
+            _mm_free(combined);
+        }
+
+    }
+
+    /**
+     * This method sorts the given key-value arrays by key, keeping elements with equal keys
+     * in their original order. Currently the keys can be of the type of int, uint32_t, and
+     * float (compared in IEEE total order, so -0 sorts before +0); the values can be of any
+     * copyable type.
+     *
+     * @param keys the pointer to the first key
+     * @param values the pointer to the first value
+     * @param size the number of elements
+     * @return the sorted keys and their values are stored in keys and values
+     *
+     */
+     //! This method sorts the given key-value arrays stably.
+    template <class K, class V>
+    void sort_stable(K* keys, V* values, uint32_t size)
+    {
+        internal::sort_stable(keys, values, size, 1);
+    }
+
+    /**
+     * This method sorts the given key-value arrays stably with thread_num threads.
+     *
+     * @param keys the pointer to the first key
+     * @param values the pointer to the first value
+     * @param size the number of elements
+     * @return the sorted keys and their values are stored in keys and values
+     *
+     */
+     //! This method sorts the given key-value arrays stably with multiple threads.
+    template <class K, class V>
+    void parallel_sort_stable(K* keys, V* values, uint32_t size)
+    {
+        internal::sort_stable(keys, values, size, thread_num);
+    }
+
+    /**
+     * This method merges two key-value arrays sorted by key into one, stably: of equal keys,
+     * those of A come first, each side in its own order.
+     *
+     * @param keysA valuesA the first sorted key-value array
+     * @param sizeA the size of the first array
+     * @param keysB valuesB the second sorted key-value array
+     * @param sizeB the size of the second array
+     * @param keys values the saving target of the merged array
+     *
+     */
+     //! This method merges two sorted key-value arrays stably.
+    template <class K, class V>
+    void merge_stable(const K* keysA, const V* valuesA, uint32_t sizeA, const K* keysB, const V* valuesB, uint32_t sizeB,
+        K* keys, V* values)
+    {
+        internal::merge_stable(keysA, valuesA, sizeA, keysB, valuesB, sizeB, keys, values, 1);
+    }
+
+    /**
+     * This method merges two key-value arrays sorted by key into one, stably, with the
+     * combined keys split across thread_num threads by merge path.
+     *
+     */
+     //! This method merges two sorted key-value arrays stably with multiple threads.
+    template <class K, class V>
+    void parallel_merge_stable(const K* keysA, const V* valuesA, uint32_t sizeA, const K* keysB, const V* valuesB, uint32_t sizeB,
+        K* keys, V* values)
+    {
+        internal::merge_stable(keysA, valuesA, sizeA, keysB, valuesB, sizeB, keys, values, thread_num);
+    }
+
+}
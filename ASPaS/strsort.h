@@ -0,0 +1,161 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file strsort.h
+ * Definition of sorting C strings by normalized prefixes. The next 8 bytes
+ * of every string are loaded big-endian into an integer that orders like
+ * strcmp() on them, the (prefix, index) pairs are sorted as integers, and
+ * every group of equal prefixes is resolved the same way with the 8 bytes
+ * after. Only small groups fall back to strcmp().
+ *
+ */
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "aspas.h"
+
+namespace aspas
+{
+
+    namespace internal
+    {
+
+        /// groups of equal prefixes below this size are finished with strcmp()
+        const uint32_t strings_cmp_max = 32;
+
+        /**
+         * This method returns the 8 bytes of s from depth on as a big-endian
+         * integer, zero-padded after the terminator. The lowest byte is zero
+         * exactly if the string ends within these bytes.
+         *
+         */
+        inline uint64_t string_prefix(const char* s, uint32_t depth)
+        {
+            const unsigned char* p = (const unsigned char*)s + depth;
+            uint64_t key = 0;
+            uint32_t i = 0;
+            for (/* cont'd */; i < 8 && p[i] != 0; i++)
+                key = (key << 8) | p[i];
+            return i == 8 ? key : key << (8 * (8 - i));
+        }
+
+        /**
+         * This method sorts perm[begin..end), strings equal in their first
+         * depth bytes, by the bytes after: by their next 8-byte prefix, then
+         * each group of equal prefixes by the bytes after it. pairs[begin..end)
+         * is the scratch of this range, as in refine_columns().
+         *
+         */
+        inline void refine_strings(const char* const* strings, uint32_t* perm, uint32_t begin, uint32_t end,
+            uint32_t depth, record_pair* pairs)
+        {
+            for (;;)
+            {
+                if (end - begin < strings_cmp_max)
+                {
+                    std::sort(perm + begin, perm + end, [strings, depth](uint32_t a, uint32_t b)
+                        {
+                            int c = strcmp(strings[a] + depth, strings[b] + depth);
+                            return c < 0 || (c == 0 && a < b);
+                        });
+                    return;
+                }
+
+                for (uint32_t j = begin; j < end; j++)
+                {
+                    pairs[j].key = string_prefix(strings[perm[j]], depth);
+                    pairs[j].index = perm[j];
+                }
+                sort_pairs(pairs + begin, end - begin);
+                for (uint32_t j = begin; j < end; j++)
+                    perm[j] = (uint32_t)pairs[j].index;
+
+                // one group of equal prefixes: go on with the next 8 bytes without recursion
+                if (pairs[begin].key == pairs[end - 1].key)
+                {
+                    if ((pairs[begin].key & 255) == 0)
+                        return;
+                    depth += 8;
+                    continue;
+                }
+
+                uint32_t run = begin;
+                for (uint32_t j = begin + 1; j <= end; j++)
+                {
+                    if (j == end || pairs[j].key != pairs[run].key)
+                    {
+                        // a prefix ending in a zero byte is the rest of equal strings
+                        if (j - run > 1 && (pairs[run].key & 255) != 0)
+                            refine_strings(strings, perm, run, j, depth + 8, pairs);
+                        run = j;
+                    }
+                }
+                return;
+            }
+        }
+
+    }
+
+    /**
+     * This method computes the permutation that sorts the given C strings in strcmp() order:
+     * perm[0] is the index of the first string. Equal strings keep their order.
+     *
+     * @param strings the pointers to the strings
+     * @param size the number of strings
+     * @param perm the saving target of the permutation, size entries
+     *
+     */
+     //! This method computes the sorted order of the given strings.
+    inline void sort_strings(const char* const* strings, uint32_t size, uint32_t* perm)
+    {
+        for (uint32_t i = 0; i < size; i++)
+            perm[i] = i;
+        if (size < 2)
+            return;
+        internal::record_pair* pairs = (internal::record_pair*)_mm_malloc(sizeof(internal::record_pair) * size, 64);
+        internal::refine_strings(strings, perm, 0, size, 0, pairs);
+        _mm_free(pairs);
+    }
+
+    /**
+     * This method sorts the given C strings in strcmp() order, by reordering the pointers.
+     * Equal strings keep their order.
+     *
+     * @param strings the pointers to the strings
+     * @param size the number of strings
+     * @return the sorted pointers are stored in strings
+     *
+     */
+     //! This method sorts the given strings.
+    inline void sort_strings(const char** strings, uint32_t size)
+    {
+        if (size < 2)
+            return;
+        uint32_t* perm = (uint32_t*)_mm_malloc(sizeof(uint32_t) * size, 64);
+        const char** sorted = (const char**)_mm_malloc(sizeof(const char*) * size, 64);
+        sort_strings(strings, size, perm);
+        apply_permutation(strings, perm, size, sorted);
+        std::copy(sorted, sorted + size, strings);
+        _mm_free(sorted);
+        _mm_free(perm);
+    }
+
+}
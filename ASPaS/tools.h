@@ -24,9 +24,17 @@
 #define UTIL_TOOLS_H_
 
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <type_traits>
+#include <immintrin.h>
  //#include <sys/time.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
 
 #include "pch.h"
 #include "aspas.h"
@@ -225,6 +233,67 @@ namespace util
         }
     }
 
+    /**
+     * This method copies n elements from b to a. With stream set, the
+     * 32-byte aligned body of a is written with non-temporal stores so a
+     * large copy does not evict the caches.
+     *
+     * @param a destination array
+     * @param b source array
+     * @param n number of elements
+     * @param stream use non-temporal stores
+     *
+     */
+    template <typename T>
+    void copy_stream(T* a, const T* b, uint64_t n, bool stream)
+    {
+        char* dst = (char*)a;
+        const char* src = (const char*)b;
+        uint64_t bytes = n * sizeof(T);
+
+        if (!stream || bytes < 4096)
+        {
+            memcpy(dst, src, bytes);
+            return;
+        }
+
+        uint64_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+        memcpy(dst, src, head);
+        uint64_t i;
+        for (i = head; i + 32 <= bytes; i += 32)
+            _mm256_stream_si256((__m256i*)(dst + i), _mm256_loadu_si256((const __m256i*)(src + i)));
+        memcpy(dst + i, src + i, bytes - i);
+        _mm_sfence();
+    }
+
+    /**
+     * This method returns the index of the lowest set bit of a nonzero mask.
+     *
+     */
+    uint32_t ctz(uint32_t mask)
+    {
+#ifdef _MSC_VER
+        unsigned long idx;
+        _BitScanForward(&idx, mask);
+        return (uint32_t)idx;
+#else
+        return (uint32_t)__builtin_ctz(mask);
+#endif
+    }
+
+    /**
+     * This method returns the number of set bits of a mask.
+     *
+     */
+    uint32_t popcnt(uint32_t mask)
+    {
+#ifdef _MSC_VER
+        return (uint32_t)__popcnt(mask);
+#else
+        return (uint32_t)__builtin_popcount(mask);
+#endif
+    }
+
     /**
      * This method returns the current timestamp.
      *
@@ -244,6 +313,163 @@ namespace util
 
 #define ELAPSED_MS(st, en)		( duration_cast<duration<double, std::milli>>(en - st).count() )
 
+    /**
+     * This method executes the cpuid instruction.
+     *
+     * @param regs output registers eax, ebx, ecx, edx
+     * @param leaf cpuid leaf (eax)
+     * @param subleaf cpuid subleaf (ecx)
+     *
+     */
+    void cpuid(int regs[4], int leaf, int subleaf)
+    {
+#ifdef _MSC_VER
+        __cpuidex(regs, leaf, subleaf);
+#else
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    }
+
+    /**
+     * The data (or unified) cache sizes in bytes by level, 0 for a level
+     * that does not exist.
+     */
+    struct cache_sizes
+    {
+        uint64_t size[4];
+    };
+
+    /**
+     * This method probes the cache sizes from the deterministic cache
+     * parameters of cpuid (leaf 4 on Intel, 0x8000001D on AMD), or from
+     * sysfs on Linux when cpuid reports nothing.
+     *
+     * @return the cache sizes
+     *
+     */
+    cache_sizes probe_caches()
+    {
+        cache_sizes caches = { { 0, 0, 0, 0 } };
+        uint64_t* sizes = caches.size;
+        int regs[4];
+        int leaves[2] = { 4, (int)0x8000001D };
+        for (int l = 0; l < 2 && sizes[1] == 0; l++)
+        {
+            cpuid(regs, leaves[l] & 0x80000000, 0);
+            if ((uint32_t)regs[0] < (uint32_t)leaves[l])
+                continue;
+            for (int sub = 0; sub < 16; sub++)
+            {
+                cpuid(regs, leaves[l], sub);
+                uint32_t type = regs[0] & 0x1f;
+                if (type == 0)
+                    break;
+                // skip instruction caches
+                if (type == 2)
+                    continue;
+                uint32_t lvl = (regs[0] >> 5) & 0x7;
+                uint64_t ways = (((uint32_t)regs[1] >> 22) & 0x3ff) + 1;
+                uint64_t partitions = (((uint32_t)regs[1] >> 12) & 0x3ff) + 1;
+                uint64_t line = ((uint32_t)regs[1] & 0xfff) + 1;
+                uint64_t sets = (uint64_t)(uint32_t)regs[2] + 1;
+                if (lvl < 4)
+                    sizes[lvl] = ways * partitions * line * sets;
+            }
+        }
+#ifdef __linux__
+        // e.g. under hypervisors that hide the cache leaves
+        bool use_sysfs = sizes[1] == 0 && sizes[2] == 0;
+        for (int idx = 0; use_sysfs && idx < 16; idx++)
+        {
+            char path[96];
+            char type[32] = { 0 };
+            char unit = 'K';
+            uint32_t lvl = 0;
+            unsigned long long size = 0;
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", idx);
+            FILE* f = fopen(path, "r");
+            if (f == NULL)
+                break;
+            bool ok = fscanf(f, "%31s", type) == 1;
+            fclose(f);
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", idx);
+            if (ok && (f = fopen(path, "r")) != NULL)
+            {
+                ok = fscanf(f, "%u", &lvl) == 1;
+                fclose(f);
+            }
+            else
+                ok = false;
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", idx);
+            if (ok && (f = fopen(path, "r")) != NULL)
+            {
+                // e.g. "48K" or "32M"; a bare number is in bytes
+                int n = fscanf(f, "%llu%c", &size, &unit);
+                ok = n >= 1;
+                if (n == 1 || unit == '\n')
+                    unit = 'B';
+                fclose(f);
+            }
+            else
+                ok = false;
+            if (!ok || strcmp(type, "Instruction") == 0 || lvl == 0 || lvl > 3)
+                continue;
+            if (unit == 'K')
+                size <<= 10;
+            else if (unit == 'M')
+                size <<= 20;
+            else if (unit == 'G')
+                size <<= 30;
+            sizes[lvl] = size;
+        }
+#endif
+        return caches;
+    }
+
+    /**
+     * This method returns the cache sizes, probed once by the first caller;
+     * the initialization of the local static is thread-safe, so workers of
+     * parallel_sort() may be the first.
+     *
+     * @return the cache sizes
+     *
+     */
+    const cache_sizes& caches()
+    {
+        static const cache_sizes probed = probe_caches();
+        return probed;
+    }
+
+    /**
+     * This method returns the size of the data (or unified) cache at the
+     * given level.
+     *
+     * @param level cache level, 1 to 3
+     * @return cache size in bytes, 0 if the level does not exist
+     *
+     */
+    uint64_t cache_size(uint32_t level)
+    {
+        return level < 4 ? caches().size[level] : 0;
+    }
+
+    /**
+     * This method returns the size of the last level cache.
+     *
+     * @return cache size in bytes, 8 MB if cpuid reports no caches
+     *
+     */
+    uint64_t llc_size()
+    {
+        const cache_sizes& probed = caches();
+        for (uint32_t level = 3; level > 0; level--)
+        {
+            if (probed.size[level] != 0)
+                return probed.size[level];
+        }
+        return 8LLU << 20;
+    }
+
 }
 
 #endif
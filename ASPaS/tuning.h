@@ -0,0 +1,167 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file tuning.h
+ * Autotuning of the in-cache block size (way) used by the merger, and
+ * loading/saving of the tuned values in a small config file.
+ *
+ * The file holds one "<type> <way>" line per key type, e.g.
+ *
+ *     int 16384
+ *     float 16384
+ *     double 8192
+ *
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+#include "pch.h"
+#include "aspas.h"
+
+namespace aspas
+{
+
+    namespace internal
+    {
+        /// key type names used in the tuning file, indexed like tuned_way
+        const char* tuned_type_names[3] = { "int", "float", "double" };
+
+        /**
+         * This method times the sorter and merger on n random keys for every
+         * power-of-two way between 256 and 65536 and returns the fastest one.
+         *
+         * @param n number of keys sorted per measurement
+         * @param repeat measurements per way, the best one counts
+         * @return the fastest way
+         *
+         */
+        template <typename T>
+        uint32_t tune_way(uint32_t n, uint32_t repeat)
+        {
+            T* keys = new T[n];
+            T* work = new T[n];
+            std::mt19937 g;
+            std::uniform_int_distribution<int> d;
+            for (uint32_t i = 0; i < n; i++)
+                keys[i] = (T)d(g);
+
+            uint32_t saved = tuned_way[type_index<T>()];
+            uint32_t best_way = 0;
+            double best = 0;
+            for (uint32_t way = 256; way <= 65536; way *= 2)
+            {
+                tuned_way[type_index<T>()] = way;
+                for (uint32_t r = 0; r < repeat; r++)
+                {
+                    std::copy(keys, keys + n, work);
+                    hrc::time_point st = hrc::now();
+                    // the merger alone: sort() may take the radix engine or keep presorted runs
+                    sorter(work, n);
+                    merger(work, n);
+                    hrc::time_point en = hrc::now();
+                    double el = ELAPSED_MS(st, en);
+                    if (best_way == 0 || el < best)
+                    {
+                        best = el;
+                        best_way = way;
+                    }
+                }
+            }
+            tuned_way[type_index<T>()] = saved;
+
+            delete[] keys;
+            delete[] work;
+            return best_way;
+        }
+    }
+
+    /**
+     * This method loads the per-type merger block sizes from a tuning file.
+     * Types missing from the file keep their current setting; values that
+     * are not a power of two are ignored.
+     *
+     * @param path tuning file written by save_tuning() or autotune()
+     * @return false if the file cannot be opened
+     *
+     */
+    bool load_tuning(const char* path)
+    {
+        FILE* f = fopen(path, "r");
+        if (f == NULL)
+            return false;
+
+        char type[16];
+        uint32_t way;
+        while (fscanf(f, "%15s %u", type, &way) == 2)
+        {
+            if (way < 16 || (way & (way - 1)) != 0)
+                continue;
+            for (int t = 0; t < 3; t++)
+            {
+                if (strcmp(type, internal::tuned_type_names[t]) == 0)
+                    internal::tuned_way[t] = way;
+            }
+        }
+        fclose(f);
+        return true;
+    }
+
+    /**
+     * This method saves the per-type merger block sizes to a tuning file.
+     * Untuned types are written with their cache-derived value.
+     *
+     * @param path target file
+     * @return false if the file cannot be written
+     *
+     */
+    bool save_tuning(const char* path)
+    {
+        FILE* f = fopen(path, "w");
+        if (f == NULL)
+            return false;
+
+        fprintf(f, "int %u\n", internal::merge_way<int>((uint8_t)simd_width::AVX_INT, 16384));
+        fprintf(f, "float %u\n", internal::merge_way<float>((uint8_t)simd_width::AVX_FLOAT, 16384));
+        fprintf(f, "double %u\n", internal::merge_way<double>((uint8_t)simd_width::AVX_DOUBLE, 8192));
+        fclose(f);
+        return true;
+    }
+
+    /**
+     * This method sweeps the merger block size for int, float and double keys
+     * on this machine, applies the fastest setting and, if path is given,
+     * persists it with save_tuning().
+     *
+     * @param path tuning file, NULL to only apply the result
+     * @param n number of keys sorted per measurement
+     * @return false if the file cannot be written
+     *
+     */
+    bool autotune(const char* path, uint32_t n = 1 << 22)
+    {
+        internal::tuned_way[internal::type_index<int>()] = internal::tune_way<int>(n, 3);
+        internal::tuned_way[internal::type_index<float>()] = internal::tune_way<float>(n, 3);
+        internal::tuned_way[internal::type_index<double>()] = internal::tune_way<double>(n, 3);
+
+        return path == NULL || save_tuning(path);
+    }
+
+}
@@ -0,0 +1,202 @@
+#pragma once
+/*
+* (c) 2015 Virginia Polytechnic Institute & State University (Virginia Tech)
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, version 2.1
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License, version 2.1, for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*
+*/
+
+/**
+ * @file unique.h
+ * Definition of sorting and merging with duplicates dropped. The last merge
+ * pass of merger() merges a tile at a time (order.h); every merged tile is
+ * compared with itself shifted by one lane and its first keys of each run
+ * are compress-stored to the output, so the duplicates never reach memory.
+ *
+ */
+
+#include <immintrin.h>
+#include <cstdint>
+
+#include "aspas.h"
+
+namespace aspas
+{
+
+    namespace internal
+    {
+
+        /**
+         * Integer version: <br>
+         * This method returns the mask of the lanes of p[0..7] equal to the
+         * key before them; the key before lane 0 is last.
+         *
+         */
+        inline uint32_t duplicate_mask(const int* p, int last)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i*)p);
+            __m256i prev = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(7, 0, 1, 2, 3, 4, 5, 6)),
+                _mm256_set1_epi32(last), 1);
+            return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, prev)));
+        }
+
+        /**
+         * Float version: <br>
+         * This method returns the mask of the lanes of p[0..7] equal to the
+         * key before them, as by ==.
+         *
+         */
+        inline uint32_t duplicate_mask(const float* p, float last)
+        {
+            __m256 v = _mm256_loadu_ps(p);
+            __m256 prev = _mm256_blend_ps(_mm256_permutevar8x32_ps(v, _mm256_setr_epi32(7, 0, 1, 2, 3, 4, 5, 6)),
+                _mm256_set1_ps(last), 1);
+            return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(v, prev, _CMP_EQ_OQ));
+        }
+
+        /**
+         * Double version: <br>
+         * This method returns the mask of the lanes of p[0..3] equal to the
+         * key before them, as by ==.
+         *
+         */
+        inline uint32_t duplicate_mask(const double* p, double last)
+        {
+            __m256d v = _mm256_loadu_pd(p);
+            __m256d prev = _mm256_blend_pd(_mm256_permute4x64_pd(v, _MM_SHUFFLE(2, 1, 0, 3)), _mm256_set1_pd(last), 1);
+            return (uint32_t)_mm256_movemask_pd(_mm256_cmp_pd(v, prev, _CMP_EQ_OQ));
+        }
+
+        /**
+         * This method copies the keys of the sorted src[0..n) that differ
+         * from the key before them to dst, which may be src. The key before
+         * src[0] is last if any is set; both are updated for the next call.
+         * Without counts the keys are compress-stored a vector at a time:
+         * the stores reach up to a vector past the last key kept, never past
+         * the last key read.
+         *
+         * @param counts if not null, counts[written + j] receives the number
+         * of copies of the jth key kept, and a run continued from the call
+         * before is added to counts[written - 1]
+         * @param written the number of keys kept by the calls before
+         * @return the number of keys kept
+         *
+         */
+        template <typename T>
+        uint32_t unique_copy(const T* src, uint32_t n, T* dst, T& last, bool& any, uint32_t* counts, uint32_t written)
+        {
+            const uint32_t lanes = 32 / sizeof(T);
+            uint32_t i = 0, w = 0;
+
+            if (counts != nullptr)
+            {
+                for (/* cont'd */; i < n; i++)
+                {
+                    if (any && src[i] == last)
+                        counts[written + w - 1]++;
+                    else
+                    {
+                        counts[written + w] = 1;
+                        dst[w++] = src[i];
+                    }
+                    last = src[i];
+                    any = true;
+                }
+                return w;
+            }
+
+            if (n == 0)
+                return 0;
+            if (!any)
+            {
+                dst[w++] = src[0];
+                last = src[0];
+                any = true;
+                i = 1;
+            }
+            for (/* cont'd */; i + lanes <= n; i += lanes)
+            {
+                // read before the store, which may overwrite it when dst is src
+                T next = src[i + lanes - 1];
+                uint32_t dup = duplicate_mask(src + i, last);
+                if (dup != (1u << lanes) - 1)
+                {
+                    __m256i perm = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)partition_lut<T>(dup)));
+                    __m256i v = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)(src + i)), perm);
+                    _mm256_storeu_si256((__m256i*)(dst + w), v);
+                    w += lanes - util::popcnt(dup);
+                }
+                last = next;
+            }
+            for (/* cont'd */; i < n; i++)
+            {
+                if (!(src[i] == last))
+                    dst[w++] = src[i];
+                last = src[i];
+            }
+            return w;
+        }
+
+    }
+
+    /**
+     * This method sorts the given input array and drops repeated keys, like std::sort followed
+     * by std::unique, but in the last merge pass: each key is written once. Currently the
+     * input array can be of the type of int, float, and double.
+     *
+     * @param array the pointer to the first element of the input array
+     * @param size the size of the input array
+     * @param counts if not null, receives the number of copies of every distinct key, room
+     * for size entries
+     * @return the number of distinct keys, stored sorted at the front of array
+     *
+     */
+     //! This method sorts the given input array and drops repeated keys.
+    template <typename T>
+    uint32_t sort_unique(T* array, uint32_t size, uint32_t* counts = nullptr)
+    {
+        if (size == 0)
+            return 0;
+        if (internal::try_radix_sort(array, size))
+        {
+            // the scatter passes have no merged tiles to fold this into
+            T last;
+            bool any = false;
+            return internal::unique_copy(array, size, array, last, any, counts, 0);
+        }
+        internal::sorter(array, size);
+        return internal::merger(array, size, internal::merge_tail(internal::key_transform(), true, counts));
+    }
+
+    /**
+     * This method merges two sorted input arrays into one and drops repeated keys, within
+     * either array as well as across them.
+     *
+     * @param inputA the first sorted array
+     * @param sizeA the size of the first array
+     * @param inputB the second sorted array
+     * @param sizeB the size of the second array
+     * @param output the saving target of the distinct keys, room for sizeA + sizeB keys
+     * @param counts if not null, receives the number of copies of every distinct key, room
+     * for sizeA + sizeB entries
+     * @return the number of distinct keys
+     *
+     */
+     //! This method merges two sorted input arrays into one and drops repeated keys.
+    template <typename T>
+    uint32_t merge_unique(T* inputA, uint32_t sizeA, T* inputB, uint32_t sizeB, T* output, uint32_t* counts = nullptr)
+    {
+        return internal::merge_decode(inputA, sizeA, inputB, sizeB, output, false,
+            internal::merge_tail(internal::key_transform(), true, counts));
+    }
+
+}